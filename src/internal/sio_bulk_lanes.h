@@ -0,0 +1,151 @@
+//
+//  sio_bulk_lanes.h
+//
+
+#ifndef SIO_BULK_LANES_H
+#define SIO_BULK_LANES_H
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace sio
+{
+    // Encoded packets waiting for room in the transport buffer, one lane per namespace, released round-robin.
+    // Not thread safe, owned by the network thread.
+    template<typename frame>
+    class bulk_lanes
+    {
+    public:
+        struct item
+        {
+            item():bytes(0),deadline(std::chrono::steady_clock::time_point::max()) {}
+
+            std::vector<frame> frames;
+            size_t bytes;
+            std::chrono::steady_clock::time_point deadline;
+            // Called instead of sending the packet when its deadline passed in the lane.
+            std::function<void()> expired;
+        };
+
+        bulk_lanes():m_packets(0),m_bytes(0) {}
+
+        void push(std::string const& nsp, item&& packet)
+        {
+            m_packets++;
+            m_bytes += packet.bytes;
+            m_lanes[nsp].push_back(std::move(packet));
+        }
+
+        // Next packet within its deadline, one namespace after another. Expired packets met on the way are dropped.
+        bool pop(item& packet, std::chrono::steady_clock::time_point now)
+        {
+            while (m_packets > 0) {
+                auto it = m_lanes.upper_bound(m_cursor);
+                if (it == m_lanes.end()) {
+                    it = m_lanes.begin();
+                }
+                m_cursor = it->first;
+                packet = std::move(it->second.front());
+                it->second.pop_front();
+                if (it->second.empty()) {
+                    m_lanes.erase(it);
+                }
+                m_packets--;
+                m_bytes -= packet.bytes;
+                if (now <= packet.deadline) {
+                    return true;
+                }
+                if (packet.expired) {
+                    packet.expired();
+                }
+            }
+            return false;
+        }
+
+        bool empty() const { return m_packets == 0; }
+
+        size_t size() const { return m_packets; }
+
+        // Encoded bytes held in the lanes.
+        size_t bytes() const { return m_bytes; }
+
+        void clear()
+        {
+            m_lanes.clear();
+            m_packets = 0;
+            m_bytes = 0;
+        }
+
+    private:
+        std::map<std::string, std::deque<item> > m_lanes;
+        std::string m_cursor;
+        size_t m_packets;
+        size_t m_bytes;
+    };
+
+    // Bytes handed to the transport and not written yet, with the watermark crossings they cause.
+    // websocketpp has no drain notification, it only releases a message once written, so each one is tracked until then.
+    // Not thread safe, owned by the network thread.
+    class write_tracker
+    {
+    public:
+        enum crossing
+        {
+            crossed_none,
+            crossed_high,
+            crossed_low
+        };
+
+        write_tracker():m_in_flight(0),m_high(0),m_low(0),m_above(false) {}
+
+        // msg counting bytes in flight until the transport releases it, then calls written.
+        template<typename message_ptr>
+        message_ptr track(message_ptr const& msg, size_t bytes, std::function<void()> const& written)
+        {
+            m_in_flight += bytes;
+            return message_ptr(msg.get(), [this, msg, bytes, written](typename message_ptr::element_type*)
+            {
+                m_in_flight -= bytes;
+                if (written) {
+                    written();
+                }
+            });
+        }
+
+        size_t in_flight() const { return m_in_flight; }
+
+        // A high watermark of 0 disables the crossings.
+        void set_watermarks(size_t high, size_t low)
+        {
+            m_high = high;
+            m_low = low < high ? low : high;
+        }
+
+        // Crossing caused by the buffered amount becoming amount, each is reported once until the other one.
+        crossing update(size_t amount)
+        {
+            if (m_high == 0) {
+                return crossed_none;
+            }
+            if (!m_above && amount >= m_high) {
+                m_above = true;
+                return crossed_high;
+            }
+            if (m_above && amount <= m_low) {
+                m_above = false;
+                return crossed_low;
+            }
+            return crossed_none;
+        }
+
+    private:
+        size_t m_in_flight;
+        size_t m_high;
+        size_t m_low;
+        bool m_above;
+    };
+}
+#endif
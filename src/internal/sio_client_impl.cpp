@@ -7,10 +7,12 @@
 //
 
 #include "sio_client_impl.h"
+#include "sio_msgpack_codec.h"
 #include <functional>
 #include <sstream>
 #include <chrono>
 #include <mutex>
+#include <future>
 #include <cmath>
 #include <stdarg.h>
 
@@ -29,12 +31,24 @@ namespace sio
 {
     /*************************public:*************************/
     template<typename client_type>
-    client_impl<client_type>::client_impl(const string& uri) : m_base_url(uri)
+    client_impl<client_type>::client_impl(const string& uri, std::shared_ptr<runtime_impl> const& runtime) : m_base_url(uri)
     {
 #ifndef DEBUG
-        set_logs_level(log_default);
+        set_logs_level_impl(log_default);
 #endif
-        io_service.reset(new asio::io_service());
+        if(runtime)
+        {
+            runtime_impl::shard const& s = runtime->next_shard();
+            io_service = s.service;
+            m_network_thread_id = s.thread.get_id();
+            m_runtime = runtime;
+        }
+        else
+        {
+            io_service.reset(new asio::io_service());
+        }
+        m_msg_manager = std::make_shared<con_msg_manager_type>();
+        m_batch.reset(new write_batch(*io_service, SIO_COALESCE_MAX, std::bind(&client_impl<client_type>::flush_coalesced,this)));
         // Initialize the Asio transport policy
         m_client.init_asio(io_service.get());
         m_client.set_open_handler(std::bind(&client_impl<client_type>::on_open,this,_1));
@@ -44,14 +58,20 @@ namespace sio
         template_init();
 
         m_packet_mgr.set_decode_callback(std::bind(&client_impl<client_type>::on_decode,this,_1));
-        m_packet_mgr.set_encode_callback(std::bind(&client_impl<client_type>::on_encode,this,_1,_2));
     }
 
     template<typename client_type>
     client_impl<client_type>::~client_impl()
     {
-        this->sockets_invoke_void(socket_on_close());
+        //the sockets share their queues and timers with the network thread, it stops before they close.
         sync_close();
+        //encode workers may still reach the sockets' client until they are joined.
+        m_encode_pool.reset();
+        close_sockets();
+        //let listeners still queued finish before the client goes away.
+        m_dispatcher.reset();
+        m_worker_pool.reset();
+        m_decode_pool.reset();
     }
 
     template<typename client_type>
@@ -89,6 +109,17 @@ namespace sio
                 return;
             }
         }
+        else if((m_polled || m_runtime) && m_con_state != con_closed)
+        {
+            if(m_con_state == con_closing)
+            {
+                finish_close();
+            }
+            else
+            {
+                return;
+            }
+        }
         m_con_state = con_opening;
         m_reconn_made = 0;
 
@@ -104,9 +135,33 @@ namespace sio
 
         m_http_headers = headers;
 
+        packet_codec::ptr codec;
+        if(m_codec == client::codec_msgpack)
+        {
+            codec = std::make_shared<msgpack_codec>();
+        }
+        else
+        {
+            codec = std::make_shared<json_codec>();
+        }
+        m_packet_mgr.set_codec(codec);
+        std::atomic_store(&m_packet_codec, codec);
+        if(!m_workers_started)
+        {
+            //the network thread and emitting threads reach these without a lock, they are set up once and kept until the client goes away.
+            m_workers_started = true;
+            this->apply_dispatch();
+            m_decode_pool.reset(m_decode_threads > 0 ? new worker_pool(m_decode_threads) : NULL);
+            m_encode_pool.reset(m_encode_threads > 0 ? new worker_pool(m_encode_threads) : NULL);
+        }
+
         this->reset_states();
         get_io_service().dispatch(std::bind(&client_impl<client_type>::connect_impl,this));
-        m_network_thread.reset(new thread(std::bind(&client_impl<client_type>::run_loop,this)));//uri lifecycle?
+        m_polled = m_manual_poll && !m_runtime;
+        if(!m_polled && !m_runtime)
+        {
+            m_network_thread.reset(new thread(std::bind(&client_impl<client_type>::run_loop,this)));//uri lifecycle?
+        }
 
     }
 
@@ -131,7 +186,9 @@ namespace sio
         else
         {
             pair<const string, socket::ptr> p(aux, create_socket(aux));
-            return (m_sockets.insert(p).first)->second;
+            socket::ptr const& created = (m_sockets.insert(p).first)->second;
+            publish_routes();
+            return created;
         }
     }
 
@@ -154,10 +211,56 @@ namespace sio
             m_network_thread->join();
             m_network_thread.reset();
         }
+        else if(m_polled || m_runtime)
+        {
+            finish_close();
+        }
+    }
+
+    template<typename client_type>
+    size_t client_impl<client_type>::poll()
+    {
+        if(m_network_thread || m_runtime)
+        {
+            //the network thread runs the client already.
+            return 0;
+        }
+        m_network_thread_id = std::this_thread::get_id();
+        restart_polled();
+        return io_service->poll();
+    }
+
+    template<typename client_type>
+    size_t client_impl<client_type>::run_one()
+    {
+        if(m_network_thread || m_runtime)
+        {
+            return 0;
+        }
+        m_network_thread_id = std::this_thread::get_id();
+        restart_polled();
+        return io_service->run_one();
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::restart_polled()
+    {
+        //a poll that found nothing to do stopped the io_service, work queued since then must still run.
+        if(io_service->stopped())
+        {
+            io_service->reset();
+        }
     }
 
     template<typename client_type>
     void client_impl<client_type>::set_logs_level(client::LogLevel level)
+    {
+        //the websocketpp loggers take no lock, the network thread is the only one using them.
+        get_io_service().dispatch(std::bind(&client_impl<client_type>::set_logs_level_impl,this,level));
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::set_logs_level_impl(client::LogLevel level)
     {
         m_client.clear_access_channels(websocketpp::log::alevel::all);
         switch (level)
@@ -177,7 +280,37 @@ namespace sio
     template<typename client_type>
     void client_impl<client_type>::send(packet& p)
     {
-        m_packet_mgr.encode(p);
+        std::vector<outbound_frame> frames;
+        encode(p,frames);
+        send_frames(p.get_nsp(),frames,std::chrono::steady_clock::time_point::max(),nullptr);
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::encode(packet& p, std::vector<outbound_frame>& frames)
+    {
+        client_base::encode(m_packet_mgr.get_codec(), p, frames);
+    }
+
+    void client_base::encode(packet_codec const& codec, packet& p, std::vector<outbound_frame>& frames)
+    {
+        bool compress = p.get_compress();
+        //acks and connects skip the bulk lanes. Disconnects stay behind the events emitted before them.
+        bool control = p.is_control();
+        packet_manager::encode(codec, p, [&](bool isBinary,shared_ptr<const string> const& payload)
+        {
+            outbound_frame encoded = {isBinary, compress, control, payload};
+            frames.push_back(encoded);
+        });
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::send_frames(std::string const& nsp, std::vector<outbound_frame> const& frames,
+                                               std::chrono::steady_clock::time_point deadline, std::function<void()> const& expired)
+    {
+        if(!frames.empty())
+        {
+            get_io_service().dispatch(std::bind(&client_impl<client_type>::enqueue_frames,this,nsp,frames,deadline,expired));
+        }
     }
 
     void client_base::remove_socket(string const& nsp)
@@ -187,7 +320,41 @@ namespace sio
         if(it!= m_sockets.end())
         {
             m_sockets.erase(it);
+            publish_routes();
+        }
+    }
+
+    void client_base::apply_dispatch()
+    {
+        if(m_dispatch_executor)
+        {
+            m_dispatcher = std::make_shared<serial_dispatcher>(m_dispatch_executor);
         }
+        else if(m_dispatch_threads > 0)
+        {
+            m_worker_pool.reset(new worker_pool(m_dispatch_threads));
+            m_dispatcher = std::make_shared<serial_dispatcher>(std::bind(&worker_pool::submit, m_worker_pool.get(), _1));
+        }
+    }
+
+    void client_base::publish_routes()
+    {
+        std::shared_ptr<socket_routes> routes = std::make_shared<socket_routes>();
+        routes->routes.reserve(m_sockets.size());
+        for(auto it = m_sockets.begin(); it != m_sockets.end(); ++it)
+        {
+            socket_routes::route r = {std::hash<std::string>()(it->first), it->first, it->second};
+            routes->routes.push_back(r);
+        }
+        //the network thread may be routing through the previous snapshot, it goes away once that is done.
+        std::atomic_store(&m_routes, std::shared_ptr<const socket_routes>(std::move(routes)));
+    }
+
+    socket::ptr client_base::route(std::string const& nsp) const
+    {
+        std::shared_ptr<const socket_routes> routes = std::atomic_load(&m_routes);
+        socket::ptr const* target = routes->find(nsp);
+        return target ? *target : socket::ptr();
     }
 
     void client_base::on_socket_closed(string const& nsp)
@@ -205,12 +372,186 @@ namespace sio
     void client_impl<client_type>::run_loop()
     {
         if (io_service) {
+            m_network_thread_id = std::this_thread::get_id();
             io_service->run();
             io_service->reset();
+            m_network_thread_id = std::thread::id();
         }
         log("run loop end");
     }
 
+    template<typename client_type>
+    void client_impl<client_type>::finish_close()
+    {
+        if(m_polled)
+        {
+            //no thread to join, run the close handshake on the polling thread, but not timers left behind.
+            io_service->reset();
+            m_network_thread_id = std::this_thread::get_id();
+            m_close_timer.reset(new asio::steady_timer(get_io_service()));
+            asio::error_code ec;
+            m_close_timer->expires_from_now(milliseconds(SIO_POLL_CLOSE_WAIT), ec);
+            m_close_timer->async_wait(std::bind(&client_impl<client_type>::timeout_close,this,std::placeholders::_1));
+            while(m_close_timer && (!m_live_con.expired() || m_reconn_timer) && io_service->run_one() > 0);
+            if(m_close_timer)
+            {
+                m_close_timer->cancel(ec);
+                m_close_timer.reset();
+                //run the aborted handler, it is bound to this client.
+                io_service->poll();
+            }
+            io_service->reset();
+            return;
+        }
+        if(on_network_thread())
+        {
+            //the shared thread cannot wait for itself, a client released here is deleted by release() once idle.
+            return;
+        }
+        //the shared thread keeps running, wait until no handler of this client is left on it.
+        std::promise<void> idle;
+        io_service->post([this, &idle]() { this->when_idle([&idle]() { idle.set_value(); }); });
+        idle.get_future().wait();
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::close_sockets()
+    {
+        if(m_runtime && !on_network_thread())
+        {
+            //the shared thread keeps running, the sockets are closed there.
+            std::promise<void> closed;
+            io_service->post([this, &closed]()
+            {
+                this->sockets_invoke_void(socket_on_close());
+                closed.set_value();
+            });
+            closed.get_future().wait();
+            return;
+        }
+        this->sockets_invoke_void(socket_on_close());
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::when_idle(std::function<void()> const& done)
+    {
+        m_idle_listeners.push_back(done);
+        check_idle(false);
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::check_idle(bool terminated)
+    {
+        if(m_idle_listeners.empty())
+        {
+            return;
+        }
+        if(!m_live_con.expired() || m_reconn_timer)
+        {
+            if(terminated && !m_idle_timer)
+            {
+                //the terminated connection is released by a handler still queued, check again after it.
+                m_idle_timer.reset(new asio::steady_timer(get_io_service()));
+                asio::error_code ec;
+                m_idle_timer->expires_from_now(milliseconds(1), ec);
+                m_idle_timer->async_wait(std::bind(&client_impl<client_type>::timeout_idle,this,std::placeholders::_1));
+            }
+            return;
+        }
+        if(m_idle_timer)
+        {
+            asio::error_code ec;
+            m_idle_timer->cancel(ec);
+            m_idle_timer.reset();
+        }
+        //run after the handler of the cancelled timer, the last one bound to this client.
+        std::vector<std::function<void()> > listeners;
+        listeners.swap(m_idle_listeners);
+        get_io_service().post([listeners]()
+        {
+            for(auto it = listeners.begin(); it != listeners.end(); ++it)
+            {
+                (*it)();
+            }
+        });
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::timeout_idle(asio::error_code const& ec)
+    {
+        if(ec)
+        {
+            return;
+        }
+        m_idle_timer.reset();
+        check_idle(true);
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::timeout_close(asio::error_code const& ec)
+    {
+        if(ec)
+        {
+            return;
+        }
+        m_close_timer.reset();
+        log("Close handshake timeout");
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::release(client* c)
+    {
+        client_impl<client_type>* impl = static_cast<client_impl<client_type>*>(c);
+        if(impl->m_runtime && impl->on_network_thread())
+        {
+            //released by one of its own handlers: handlers bound to it are still queued on the shared thread.
+            impl->close();
+            impl->when_idle([impl]() { delete impl; });
+            return;
+        }
+        delete impl;
+    }
+
+    runtime_impl::runtime_impl(unsigned threads):
+        m_next(0)
+    {
+        for(unsigned i = 0; i < threads; ++i)
+        {
+            std::unique_ptr<shard> s(new shard());
+            s->service = std::make_shared<asio::io_service>();
+            s->work.reset(new asio::io_service::work(*s->service));
+            std::shared_ptr<asio::io_service> service = s->service;
+            s->thread = std::thread([service]() { service->run(); });
+            m_shards.push_back(std::move(s));
+        }
+    }
+
+    runtime_impl::~runtime_impl()
+    {
+        for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+        {
+            //queued handlers still run, the threads stop once they are out of work.
+            (*it)->work.reset();
+        }
+        for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+        {
+            if((*it)->thread.get_id() == std::this_thread::get_id())
+            {
+                //released by a handler on its own thread.
+                (*it)->thread.detach();
+            }
+            else
+            {
+                (*it)->thread.join();
+            }
+        }
+    }
+
+    runtime_impl::shard const& runtime_impl::next_shard()
+    {
+        return *m_shards[m_next.fetch_add(1, std::memory_order_relaxed) % m_shards.size()];
+    }
+
     template<typename client_type>
     void client_impl<client_type>::connect_impl()
     {
@@ -256,7 +597,15 @@ namespace sio
             for( auto&& header: m_http_headers ) {
                 con->replace_header(header.first, header.second);
             }
+#if SIO_DEFLATE
+            if(m_compression)
+            {
+                //websocketpp keeps this offer, and negotiates the server's answer to it.
+                con->replace_header("Sec-WebSocket-Extensions", deflate_offer(m_compression_window_bits, m_compression_context_takeover));
+            }
+#endif
 
+            m_live_con = con;
             m_client.connect(con);
             return;
         }
@@ -288,16 +637,161 @@ namespace sio
     }
 
     template<typename client_type>
-    void client_impl<client_type>::send_impl(shared_ptr<const string> const& payload_ptr,frame::opcode::value opcode)
+    void client_impl<client_type>::send_impl(shared_ptr<const string> const& payload_ptr,frame::opcode::value opcode,bool compress)
     {
         if(m_con_state == con_opened)
         {
             lib::error_code ec;
-            m_client.send(m_con,*payload_ptr,opcode,ec);
+            message_ptr msg;
+#if SIO_DEFLATE
+            bool compressed = compress && m_deflate_negotiated && payload_ptr->size() >= m_compression_threshold;
+#else
+            //without the extension websocketpp sends flagged messages as they are, through its copying path.
+            bool compressed = false;
+            (void)compress;
+#endif
+            if(!compressed && (m_coalesce_delay > 0 || m_batch->corked()))
+            {
+                mask_frame(m_batch->frames(),*payload_ptr,opcode);
+                //bound the batch, and wait out the delay budget unless corked.
+                m_batch->appended(m_coalesce_delay);
+                return;
+            }
+            //frames already batched go first.
+            flush_coalesced();
+            if(compressed)
+            {
+                //websocketpp compresses messages flagged so, once the extension is negotiated.
+                msg = m_msg_manager->get_message(opcode,payload_ptr->size());
+                msg->append_payload(*payload_ptr);
+                msg->set_compressed(true);
+            }
+            else
+            {
+                msg = prepare_frame(*payload_ptr,opcode);
+            }
+            m_client.send(m_con,track_write(msg),ec);
             if(ec)
             {
                 cerr<<"Send failed,reason:"<< ec.message()<<endl;
             }
+            update_buffered_amount(transport_buffered_amount());
+        }
+    }
+
+    template<typename client_type>
+    size_t client_impl<client_type>::transport_buffered_amount()
+    {
+        //events held in the bulk lanes are buffered as well, only not handed to websocketpp yet.
+        return m_writes.in_flight() + m_bulk_lanes.bytes();
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::update_buffered_amount(size_t amount)
+    {
+        m_buffered_amount.store(amount, std::memory_order_relaxed);
+        switch(m_writes.update(amount))
+        {
+        case write_tracker::crossed_high:
+            if(m_high_watermark_listener) m_high_watermark_listener();
+            break;
+        case write_tracker::crossed_low:
+            if(m_low_watermark_listener) m_low_watermark_listener();
+            break;
+        default:
+            break;
+        }
+    }
+
+    template<typename client_type>
+    typename client_impl<client_type>::message_ptr client_impl<client_type>::prepare_frame(string const& payload,frame::opcode::value opcode)
+    {
+        //websocketpp writes prepared frames as they are.
+        message_ptr msg = m_msg_manager->get_message(opcode,0);
+        mask_frame(msg->get_raw_payload(),payload,opcode);
+        msg->set_prepared(true);
+        return msg;
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::mask_frame(string& out,string const& payload,frame::opcode::value opcode)
+    {
+        //append header and payload, masked straight from the encoded buffer.
+        frame::masking_key_type key;
+        key.i = m_mask_rng();
+        frame::basic_header header(opcode,payload.size(),true,true);
+        frame::extended_header extended(payload.size(),key.i);
+        out.append(frame::prepare_header(header,extended));
+        size_t offset = out.size();
+        out.resize(offset + payload.size());
+        frame::word_mask_exact(reinterpret_cast<uint8_t*>(const_cast<char*>(payload.data())),reinterpret_cast<uint8_t*>(&out[offset]),payload.size(),key);
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::flush_coalesced()
+    {
+        if(m_batch->empty())
+        {
+            return;
+        }
+        //the batched frames go out as one prepared message, so one socket write.
+        message_ptr msg = m_msg_manager->get_message(frame::opcode::binary,0);
+        m_batch->take(msg->get_raw_payload());
+        msg->set_prepared(true);
+        lib::error_code ec;
+        m_client.send(m_con,track_write(msg),ec);
+        if(ec)
+        {
+            cerr<<"Send failed,reason:"<< ec.message()<<endl;
+        }
+        update_buffered_amount(transport_buffered_amount());
+    }
+
+    template<typename client_type>
+    typename client_impl<client_type>::message_ptr client_impl<client_type>::track_write(message_ptr const& msg)
+    {
+        //websocketpp releases a message once it is written, which is when the bulk window gains room and the buffered amount falls.
+        return m_writes.track(msg, msg->get_payload().size(), std::bind(&client_impl<client_type>::on_written,this));
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::on_written()
+    {
+        //called from within websocketpp's write handler, the lanes and the listeners run once it returns.
+        if(!m_written_posted)
+        {
+            m_written_posted = true;
+            get_io_service().post([this]()
+            {
+                m_written_posted = false;
+                this->release_bulk();
+                this->update_buffered_amount(this->transport_buffered_amount());
+            });
+        }
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::cork()
+    {
+        get_io_service().dispatch(std::bind(&client_impl<client_type>::cork_impl,this,true));
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::uncork()
+    {
+        get_io_service().dispatch(std::bind(&client_impl<client_type>::cork_impl,this,false));
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::cork_impl(bool corked)
+    {
+        if(corked)
+        {
+            m_batch->cork();
+        }
+        else
+        {
+            m_batch->uncork();
         }
     }
 
@@ -315,6 +809,7 @@ namespace sio
         {
             send_impl(payload, frame::opcode::text);
         });
+        flush_coalesced();
         if(!m_ping_timeout_timer)
         {
             m_ping_timeout_timer.reset(new asio::steady_timer(get_io_service()));
@@ -361,35 +856,26 @@ namespace sio
         return static_cast<unsigned>(min<double>(m_reconn_delay * pow(1.5,reconn_made),m_reconn_delay_max));
     }
 
-    socket::ptr client_base::get_socket_locked(string const& nsp)
-    {
-        lock_guard<mutex> guard(m_socket_mutex);
-        auto it = m_sockets.find(nsp);
-        if(it != m_sockets.end())
-        {
-            return it->second;
-        }
-        else
-        {
-            return socket::ptr();
-        }
-    }
-
     void client_base::sockets_invoke_void(void (sio::socket::*fn)(void))
     {
-        map<const string,socket::ptr> socks;
+        std::shared_ptr<const socket_routes> routes;
         {
             lock_guard<mutex> guard(m_socket_mutex);
-            socks.insert(m_sockets.begin(),m_sockets.end());
+            routes = m_routes;
         }
-        for (auto it = socks.begin(); it!=socks.end(); ++it) {
-            ((*(it->second)).*fn)();
+        for (auto it = routes->routes.begin(); it!=routes->routes.end(); ++it) {
+            ((*(it->target)).*fn)();
         }
     }
 
     template<typename client_type>
     void client_impl<client_type>::on_fail(connection_hdl con)
     {
+        if(m_runtime)
+        {
+            //websocketpp releases the connection after this handler, which may be what a waiter on the shared thread needs.
+            get_io_service().post(std::bind(&client_impl<client_type>::check_idle,this,true));
+        }
         if (m_con_state == con_closing) {
             log("Connection failed while closing.");
             this->close();
@@ -428,6 +914,22 @@ namespace sio
         log("Connected.");
         m_con_state = con_opened;
         m_con = con;
+#if SIO_DEFLATE
+        lib::error_code ec;
+        typename client_type::connection_ptr conn_ptr = m_client.get_con_from_hdl(con, ec);
+        deflate_negotiation deflate;
+        if(m_compression && !ec)
+        {
+            deflate = negotiate_deflate(conn_ptr->get_response_header("Sec-WebSocket-Extensions"));
+        }
+        m_deflate_negotiated = deflate.enabled;
+        if(deflate.enabled)
+        {
+            log("permessage-deflate: server window %u bits%s, client window %u bits%s",
+                deflate.server_max_window_bits, deflate.server_no_context_takeover ? " without context takeover" : "",
+                deflate.client_max_window_bits, deflate.client_no_context_takeover ? " without context takeover" : "");
+        }
+#endif
         m_reconn_made = 0;
         this->sockets_invoke_void(socket_on_open());
         this->socket("");
@@ -437,6 +939,10 @@ namespace sio
     template<typename client_type>
     void client_impl<client_type>::on_close(connection_hdl con)
     {
+        if(m_runtime)
+        {
+            get_io_service().post(std::bind(&client_impl<client_type>::check_idle,this,true));
+        }
         log("Client Disconnected.");
         con_state m_con_state_was = m_con_state;
         m_con_state = con_closed;
@@ -453,6 +959,13 @@ namespace sio
         }
         m_con.reset();
         this->clear_timers();
+        //whatever was buffered is gone with the connection.
+        m_bulk_lanes.clear();
+        m_batch->clear();
+        //frames still being decoded belong to the closed connection.
+        m_inbound.clear();
+        //frames websocketpp still holds are counted down as the connection releases them.
+        update_buffered_amount(transport_buffered_amount());
         client::close_reason reason;
 
         // If we initiated the close, no matter what the close status was,
@@ -495,7 +1008,54 @@ namespace sio
             m_ping_timeout_timer->async_wait(std::bind(&client_impl<client_type>::timeout_pong, this, std::placeholders::_1));
         }
         // Parse the incoming message according to socket.IO rules
-        m_packet_mgr.put_payload(msg->get_payload());
+        // websocketpp drops the message after this handler, so its payload can be taken over.
+        m_packet_mgr.set_insitu_decode(m_zero_copy_decode);
+        shared_ptr<string> payload = std::make_shared<string>(std::move(msg->get_raw_payload()));
+        bool large = payload->size() >= m_decode_threshold;
+        //pings skip the frames being decoded, heartbeats do not wait for a large payload.
+        if(!m_decode_pool || (!large && m_inbound.empty()) || (*payload)[0] == '0' + packet::frame_ping)
+        {
+            m_packet_mgr.put_payload(payload);
+            return;
+        }
+        shared_ptr<inbound_frame> frame = std::make_shared<inbound_frame>();
+        frame->payload = std::move(payload);
+        m_inbound.push_back(frame);
+        if(large)
+        {
+            m_decode_pool->submit(std::bind(&client_impl<client_type>::decode_inbound, this, frame, m_zero_copy_decode));
+        }
+        else
+        {
+            frame->done.store(true, std::memory_order_relaxed);
+            drain_inbound();
+        }
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::decode_inbound(shared_ptr<inbound_frame> const& frame, bool insitu)
+    {
+        frame->whole = m_packet_mgr.decode_whole(frame->payload, insitu, frame->decoded);
+        frame->done.store(true, std::memory_order_release);
+        get_io_service().post(std::bind(&client_impl<client_type>::drain_inbound, this));
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::drain_inbound()
+    {
+        while(!m_inbound.empty() && m_inbound.front()->done.load(std::memory_order_acquire))
+        {
+            shared_ptr<inbound_frame> frame = std::move(m_inbound.front());
+            m_inbound.pop_front();
+            if(frame->whole)
+            {
+                m_packet_mgr.put_packet(std::move(frame->decoded));
+            }
+            else
+            {
+                m_packet_mgr.put_payload(frame->payload);
+            }
+        }
     }
 
     template<typename client_type>
@@ -546,6 +1106,7 @@ failed:
         {
             send_impl(payload, frame::opcode::text);
         });
+        flush_coalesced();
 
         if(m_ping_timeout_timer)
         {
@@ -555,14 +1116,14 @@ failed:
     }
 
     template<typename client_type>
-    void client_impl<client_type>::on_decode(packet const& p)
+    void client_impl<client_type>::on_decode(packet&& p)
     {
         switch(p.get_frame())
         {
         case packet::frame_message:
         {
-            socket::ptr so_ptr = get_socket_locked(p.get_nsp());
-            if(so_ptr)socket_on_message_packet(so_ptr, p);
+            socket::ptr so_ptr = route(p.get_nsp());
+            if(so_ptr)socket_on_message_packet(std::move(so_ptr), std::move(p));
             break;
         }
         case packet::frame_open:
@@ -582,10 +1143,56 @@ failed:
     }
 
     template<typename client_type>
-    void client_impl<client_type>::on_encode(bool isBinary,shared_ptr<const string> const& payload)
+    void client_impl<client_type>::enqueue_frames(std::string const& nsp, std::vector<outbound_frame> const& frames,
+                                                  std::chrono::steady_clock::time_point deadline, std::function<void()> const& expired)
     {
-        log("encoded payload length: %d", payload->length());
-        get_io_service().dispatch(std::bind(&client_impl<client_type>::send_impl,this,payload,isBinary?frame::opcode::binary:frame::opcode::text));
+        if(frames.front().control || m_bulk_window == 0)
+        {
+            send_frames_now(frames);
+            return;
+        }
+        bulk_lanes<outbound_frame>::item packet;
+        packet.frames = frames;
+        for(auto it = frames.begin(); it != frames.end(); ++it)
+        {
+            packet.bytes += it->payload->size();
+        }
+        packet.deadline = deadline;
+        packet.expired = expired;
+        m_bulk_lanes.push(nsp, std::move(packet));
+        release_bulk();
+        update_buffered_amount(transport_buffered_amount());
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::send_frames_now(std::vector<outbound_frame> const& frames)
+    {
+        for(auto it = frames.begin(); it != frames.end(); ++it)
+        {
+            log("encoded payload length: %d", it->payload->length());
+            send_impl(it->payload, it->binary?frame::opcode::binary:frame::opcode::text, it->compress);
+        }
+        if(frames.front().control)
+        {
+            //control frames do not wait for the delay budget, nor for uncork.
+            flush_coalesced();
+        }
+    }
+
+    template<typename client_type>
+    void client_impl<client_type>::release_bulk()
+    {
+        //hand bulk packets to websocketpp only while its buffer is below the window, so control frames wait behind at most that much.
+        //once full, the next write websocketpp completes releases more.
+        bulk_lanes<outbound_frame>::item packet;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while(m_con_state == con_opened && !m_bulk_lanes.empty() && m_writes.in_flight() < m_bulk_window)
+        {
+            if(m_bulk_lanes.pop(packet, now))
+            {
+                send_frames_now(packet.frames);
+            }
+        }
     }
 
     template<typename client_type>
@@ -603,7 +1210,11 @@ failed:
     template<typename client_type>
     void client_impl<client_type>::reset_states()
     {
-        io_service->reset();
+        if(!m_runtime)
+        {
+            //a shared io_service never runs out of work, and must not be reset while its thread runs it.
+            io_service->reset();
+        }
         m_sid.clear();
         m_packet_mgr.reset();
     }
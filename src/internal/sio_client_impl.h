@@ -12,6 +12,7 @@
 #define INTIALIZER(__TYPE__) (__TYPE__)
 #endif
 #include <websocketpp/client.hpp>
+#include <websocketpp/frame.hpp>
 #if _DEBUG || DEBUG
 #if SIO_TLS
 #include <websocketpp/config/debug_asio.hpp>
@@ -32,24 +33,188 @@ typedef websocketpp::config::asio_client client_config;
 #include <asio/ssl/context.hpp>
 #endif
 
+#if SIO_DEFLATE
+#include "sio_deflate.h"
+#endif
+
+#include <websocketpp/concurrency/none.hpp>
+
 #include <asio/steady_timer.hpp>
 #include <asio/error_code.hpp>
 #include <asio/io_service.hpp>
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <map>
+#include <random>
 #include <thread>
+#include <vector>
 #include "../sio_client.h"
 #include "sio_packet.h"
+#include "sio_dispatcher.h"
+#include "sio_message_pool.h"
+#include "sio_bulk_lanes.h"
+#include "sio_write_batch.h"
+
+#ifndef SIO_READ_BUFFER_SIZE
+// Bytes read from the socket at once per connection, most socket.io frames are far smaller than websocketpp's 16KB.
+#define SIO_READ_BUFFER_SIZE 8192
+#endif
+
+#ifndef SIO_BULK_WINDOW
+// Default bulk window in bytes: events wait while the transport buffers this much, pongs and acks do not.
+#define SIO_BULK_WINDOW 65536
+#endif
+
+#ifndef SIO_COALESCE_MAX
+// Bytes of coalesced frames written at once, a batch reaching it goes out without waiting out the delay budget.
+#define SIO_COALESCE_MAX 65536
+#endif
+
+#ifndef SIO_POLL_CLOSE_WAIT
+// Milliseconds a manually polled client waits for its close handshake, on close() from the polling thread.
+#define SIO_POLL_CLOSE_WAIT 5000
+#endif
 
 namespace sio
 {
     using namespace websocketpp;
-    
-    typedef websocketpp::client<client_config> client_type_no_tls;
+
+#if SIO_TRANSPORT_LOCKING
+    typedef client_config transport_client_config;
+#if SIO_TLS
+    typedef client_config_tls transport_client_config_tls;
+#endif
+#else
+    // Client config for a transport used from its network thread only: connect, send and close are all dispatched there.
+    // Drops websocketpp's locks and strands, and recycles frame buffers.
+    template<typename base_config>
+    struct single_thread_config : public base_config
+    {
+        typedef single_thread_config type;
+
+        typedef websocketpp::concurrency::none concurrency_type;
+        typedef websocketpp::log::basic<concurrency_type, websocketpp::log::elevel> elog_type;
+        typedef websocketpp::log::basic<concurrency_type, websocketpp::log::alevel> alog_type;
+        typedef websocketpp::random::random_device::int_generator<uint32_t, concurrency_type> rng_type;
+
+        typedef websocketpp::message_buffer::message<pooled_msg_manager> message_type;
+        typedef pooled_msg_manager<message_type> con_msg_manager_type;
+        typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<con_msg_manager_type> endpoint_msg_manager_type;
+
+        static const size_t connection_read_buffer_size = SIO_READ_BUFFER_SIZE;
+
+        struct transport_config : public base_config::transport_config
+        {
+            typedef typename type::concurrency_type concurrency_type;
+            typedef typename type::alog_type alog_type;
+            typedef typename type::elog_type elog_type;
+
+            static const bool enable_multithreading = false;
+        };
+
+        typedef websocketpp::transport::asio::endpoint<transport_config> transport_type;
+    };
+
+    typedef single_thread_config<client_config> transport_client_config;
 #if SIO_TLS
-    typedef websocketpp::client<client_config_tls> client_type_tls;
+    typedef single_thread_config<client_config_tls> transport_client_config_tls;
 #endif
+#endif //SIO_TRANSPORT_LOCKING
+
+#if SIO_DEFLATE
+    // Client config with the permessage-deflate extension, requires zlib.
+    template<typename base_config>
+    struct deflate_config : public base_config
+    {
+        typedef deflate_config type;
+
+        typedef sio::permessage_deflate_config permessage_deflate_config;
+
+        typedef deflate_extension permessage_deflate_type;
+    };
+
+    typedef websocketpp::client<deflate_config<transport_client_config> > client_type_no_tls;
+#if SIO_TLS
+    typedef websocketpp::client<deflate_config<transport_client_config_tls> > client_type_tls;
+#endif
+#else
+    typedef websocketpp::client<transport_client_config> client_type_no_tls;
+#if SIO_TLS
+    typedef websocketpp::client<transport_client_config_tls> client_type_tls;
+#endif
+#endif //SIO_DEFLATE
+
+    // An encoded frame ready for the transport.
+    struct outbound_frame
+    {
+        bool binary;
+        bool compress;
+        bool control;//sent ahead of bulk frames.
+        std::shared_ptr<const std::string> payload;
+    };
+
+    // A received frame waiting for its turn to be delivered, decoded on a worker when large.
+    struct inbound_frame
+    {
+        std::shared_ptr<std::string> payload;
+        packet decoded;
+        bool whole = false;//decoded holds the packet of the frame.
+        std::atomic<bool> done{false};
+    };
+
+    // Threads of a client_runtime, each running an io_service of its own shared by the clients assigned to it.
+    class runtime_impl : public client_runtime
+    {
+    public:
+        struct shard
+        {
+            std::shared_ptr<asio::io_service> service;
+            std::unique_ptr<asio::io_service::work> work;
+            std::thread thread;
+        };
+
+        explicit runtime_impl(unsigned threads);
+
+        ~runtime_impl();
+
+        unsigned get_threads() const { return (unsigned)m_shards.size(); }
+
+        // Shard of a new client, assigned round robin.
+        shard const& next_shard();
+
+    private:
+        std::vector<std::unique_ptr<shard>> m_shards;
+        std::atomic<unsigned> m_next;
+    };
+
+    // Immutable snapshot of the sockets by namespace, rebuilt when a socket is added or removed.
+    class socket_routes
+    {
+    public:
+        struct route
+        {
+            size_t hash;
+            std::string nsp;
+            socket::ptr target;
+        };
+
+        std::vector<route> routes;
+
+        socket::ptr const* find(std::string const& nsp) const
+        {
+            size_t hash = std::hash<std::string>()(nsp);
+            for(auto it = routes.begin(); it != routes.end(); ++it)
+            {
+                if(it->hash == hash && it->nsp == nsp)
+                {
+                    return &it->target;
+                }
+            }
+            return NULL;
+        }
+    };
 
     class client_base : public client {
 		public:
@@ -61,7 +226,7 @@ namespace sio
             con_closed
         };
 
-        client_base() {}
+        client_base() : m_network_thread_id(std::thread::id()) {}
         virtual ~client_base() {}
 
         //set listeners and event bindings.
@@ -82,6 +247,10 @@ namespace sio
         SYNTHESIS_SETTER(client::socket_listener,socket_open_listener)
         
         SYNTHESIS_SETTER(client::socket_listener,socket_close_listener)
+
+        SYNTHESIS_SETTER(client::con_listener,high_watermark_listener)
+
+        SYNTHESIS_SETTER(client::con_listener,low_watermark_listener)
         
 #undef SYNTHESIS_SETTER
         
@@ -92,6 +261,8 @@ namespace sio
             m_fail_listener = nullptr;
             m_reconnect_listener = nullptr;
             m_reconnecting_listener = nullptr;
+            m_high_watermark_listener = nullptr;
+            m_low_watermark_listener = nullptr;
         }
         
         void clear_socket_listeners()
@@ -109,12 +280,50 @@ namespace sio
         void set_reconnect_delay(unsigned millis) { m_reconn_delay = millis; if (m_reconn_delay_max < millis) m_reconn_delay_max = millis; }
         void set_reconnect_delay_max(unsigned millis) { m_reconn_delay_max = millis; if (m_reconn_delay > millis) m_reconn_delay = millis; }
 
+        void set_zero_copy_decode(bool enabled) { m_zero_copy_decode = enabled; }
+
+        void set_codec(client::codec_type codec) { m_codec = codec; }
+
+        void set_compression(bool enabled) { m_compression = enabled; }
+
+        void set_compression_window_bits(unsigned bits) { m_compression_window_bits = bits < 8 ? 8 : (bits > 15 ? 15 : bits); }
+
+        void set_compression_context_takeover(bool enabled) { m_compression_context_takeover = enabled; }
+
+        void set_compression_threshold(size_t bytes) { m_compression_threshold = bytes; }
+
+        size_t get_buffered_amount() const { return m_buffered_amount.load(std::memory_order_relaxed); }
+
+        void set_buffered_amount_watermarks(size_t high, size_t low) { get_io_service().dispatch(std::bind(&write_tracker::set_watermarks,&m_writes,high,low)); }
+
+        void set_bulk_window(size_t bytes) { m_bulk_window = bytes; }
+
+        void set_write_coalescing(unsigned delay_micros) { m_coalesce_delay = delay_micros; }
+        void set_parallel_decode(unsigned threads, size_t threshold_bytes) { m_decode_threads = threads; m_decode_threshold = threshold_bytes; }
+        void set_parallel_encode(unsigned threads) { m_encode_threads = threads; }
+        void set_dispatch_threads(unsigned threads) { m_dispatch_threads = threads; }
+        void set_dispatch_executor(client::executor const& e) { m_dispatch_executor = e; }
+        void set_dispatch_order(client::dispatch_order order) { m_dispatch_order = order; }
+        void set_manual_poll(bool enabled) { m_manual_poll = enabled; }
+
     public:
         static bool is_tls(const string& uri);
         // Percent encode query string
         static std::string encode_query_string(const std::string &query);
 
         virtual void send(packet& p) = 0;
+        // Encode p into frames to be sent later, in order, through send_frames.
+        virtual void encode(packet& p, std::vector<outbound_frame>& frames) = 0;
+        // Same with codec, touching no state of the client so it may run on a worker.
+        static void encode(packet_codec const& codec, packet& p, std::vector<outbound_frame>& frames);
+        // Codec of the current connection, from any thread.
+        packet_codec::ptr get_codec() const { return std::atomic_load(&m_packet_codec); }
+        // Frames of an event past its deadline in a bulk lane are dropped, and expired is called instead.
+        virtual void send_frames(std::string const& nsp, std::vector<outbound_frame> const& frames,
+                                 std::chrono::steady_clock::time_point deadline, std::function<void()> const& expired) = 0;
+        // Current buffered amount of the transport, network thread only.
+        virtual size_t transport_buffered_amount() = 0;
+        bool on_network_thread() const { return m_network_thread_id.load() == std::this_thread::get_id(); }
         asio::io_service& get_io_service() { return *io_service; }
         virtual void log(const char* fmt, ...) = 0;
 
@@ -123,13 +332,23 @@ namespace sio
         virtual void remove_socket(std::string const& nsp);
 
         sio::socket::ptr const& socket(const std::string& nsp);
-        socket::ptr get_socket_locked(std::string const& nsp);
+        // Serializes event listeners off the network thread, null when they run inline.
+        std::shared_ptr<serial_dispatcher> const& get_dispatcher() const { return m_dispatcher; }
+        client::dispatch_order get_dispatch_order() const { return m_dispatch_order; }
+        // Encodes socket::emit_async packets, null to encode them on the network thread.
+        worker_pool* get_encode_pool() const { return m_encode_pool.get(); }
+        // Socket of nsp, null when there is none, read from the current snapshot without locking.
+        socket::ptr route(std::string const& nsp) const;
     protected:
         void sockets_invoke_void(void (sio::socket::*fn)(void));
 
+        void publish_routes();
+
+        void apply_dispatch();
+
     protected:
         // Wrap protected member functions of sio::socket because only client_impl_base is friended.
-        void socket_on_message_packet(sio::socket::ptr s, packet const& p) { s->on_message_packet(p); }
+        void socket_on_message_packet(sio::socket::ptr s, packet&& p) { s->on_message_packet(std::move(p)); }
         socket::ptr create_socket(const std::string& nsp) { return socket::create(this, nsp); }
         typedef void (sio::socket::*socket_void_fn)(void);
         inline socket_void_fn socket_on_close() { return &sio::socket::on_close; }
@@ -144,6 +363,8 @@ namespace sio
         con_listener m_reconnecting_listener;
         reconnect_listener m_reconnect_listener;
         close_listener m_close_listener;
+        con_listener m_high_watermark_listener;
+        con_listener m_low_watermark_listener;
 
         client::socket_listener m_socket_open_listener;
         client::socket_listener m_socket_close_listener;
@@ -153,20 +374,65 @@ namespace sio
         unsigned m_reconn_attempts = 0xFFFFFFFF;
         unsigned m_reconn_made = 0;
 
-        std::unique_ptr<asio::io_service> io_service;
+        bool m_zero_copy_decode = false;
+        client::codec_type m_codec = client::codec_json;
+        // Set by connect() with std::atomic_store, emit_async snapshots it for its encode workers.
+        packet_codec::ptr m_packet_codec = std::make_shared<json_codec>();
+
+        bool m_compression = true;
+        unsigned m_compression_window_bits = 15;
+        bool m_compression_context_takeover = true;
+        size_t m_compression_threshold = 1024;
+
+        std::atomic<size_t> m_buffered_amount{0};
+        // Frames handed to websocketpp until written, and the watermarks on the buffered amount, network thread only.
+        write_tracker m_writes;
+        size_t m_bulk_window = SIO_BULK_WINDOW;
+        unsigned m_coalesce_delay = 0;
+
+        unsigned m_decode_threads = 0;
+        size_t m_decode_threshold = 256 * 1024;
+
+        unsigned m_encode_threads = 0;
+        std::unique_ptr<worker_pool> m_encode_pool;
+
+        unsigned m_dispatch_threads = 0;
+        client::executor m_dispatch_executor;
+        client::dispatch_order m_dispatch_order = client::dispatch_by_namespace;
+        std::unique_ptr<worker_pool> m_worker_pool;
+        std::shared_ptr<serial_dispatcher> m_dispatcher;
+        // The dispatcher and the pools exist, from the first connect on.
+        bool m_workers_started = false;
+
+        std::atomic<std::thread::id> m_network_thread_id;
+
+        bool m_manual_poll = false;
+        // The current connection is driven by poll() and run_one(), not by a network thread.
+        bool m_polled = false;
+
+        std::shared_ptr<asio::io_service> io_service;
+        // Owner of io_service when it runs on a shared thread, null for a client running its own.
+        std::shared_ptr<runtime_impl> m_runtime;
         std::map<const std::string, socket::ptr> m_sockets;
         std::mutex m_socket_mutex;
+
+        // Snapshot of m_sockets, replaced with std::atomic_store under m_socket_mutex and read with std::atomic_load.
+        std::shared_ptr<const socket_routes> m_routes = std::make_shared<socket_routes>();
     };
 
     template<typename client_type>
     class client_impl: public client_base {
     public:
         typedef typename client_type::message_ptr message_ptr;
+        typedef typename client_type::connection_type::con_msg_manager_type con_msg_manager_type;
 
-        client_impl(const std::string& uri = std::string());
+        client_impl(const std::string& uri = std::string(), std::shared_ptr<runtime_impl> const& runtime = nullptr);
         void template_init(); // template-specific initialization
 
         ~client_impl();
+
+        // Deleter of clients on a shared runtime, which may be released on their own network thread.
+        static void release(client* c);
         
  
         // Client Functions - such as send, etc.
@@ -178,21 +444,68 @@ namespace sio
         void close();
         
         void sync_close();
+
+        void cork();
+
+        void uncork();
+
+        size_t poll();
+
+        size_t run_one();
         
         void log(const char* fmt, ...);
 		void set_logs_level(client::LogLevel level);
 
     public:
         void send(packet& p);
+
+        void encode(packet& p, std::vector<outbound_frame>& frames);
+
+        void send_frames(std::string const& nsp, std::vector<outbound_frame> const& frames,
+                         std::chrono::steady_clock::time_point deadline, std::function<void()> const& expired);
+
+        size_t transport_buffered_amount();
                        
     private:
         void run_loop();
 
+        void restart_polled();
+
+        void finish_close();
+
+        // Closes the sockets once sync_close has stopped the client, on the network thread when it is shared.
+        void close_sockets();
+
+        void set_logs_level_impl(client::LogLevel level);
+
+        // Calls done on the network thread once no handler of this client is queued there any more.
+        void when_idle(std::function<void()> const& done);
+
+        void check_idle(bool terminated);
+
+        void timeout_idle(asio::error_code const& ec);
+
+        void timeout_close(asio::error_code const& ec);
+
         void connect_impl();
 
         void close_impl(close::status::value const& code,std::string const& reason);
         
-        void send_impl(std::shared_ptr<const std::string> const&  payload_ptr,frame::opcode::value opcode);
+        void send_impl(std::shared_ptr<const std::string> const&  payload_ptr,frame::opcode::value opcode,bool compress = true);
+
+        message_ptr prepare_frame(std::string const& payload,frame::opcode::value opcode);
+
+        void mask_frame(std::string& out,std::string const& payload,frame::opcode::value opcode);
+
+        void flush_coalesced();
+
+        message_ptr track_write(message_ptr const& msg);
+
+        void on_written();
+
+        void cork_impl(bool corked);
+
+        void update_buffered_amount(size_t amount);
         
         void ping(const asio::error_code& ec);
         
@@ -203,8 +516,13 @@ namespace sio
         unsigned next_delay() const;
 
         
-        void on_decode(packet const& pack);
-        void on_encode(bool isBinary,shared_ptr<const string> const& payload);
+        void on_decode(packet&& pack);
+        void enqueue_frames(std::string const& nsp, std::vector<outbound_frame> const& frames,
+                            std::chrono::steady_clock::time_point deadline, std::function<void()> const& expired);
+
+        void send_frames_now(std::vector<outbound_frame> const& frames);
+
+        void release_bulk();
         //websocket callbacks
         void on_fail(connection_hdl con);
 
@@ -214,6 +532,10 @@ namespace sio
 
         void on_message(connection_hdl con, message_ptr msg);
 
+        void decode_inbound(std::shared_ptr<inbound_frame> const& frame, bool insitu);
+
+        void drain_inbound();
+
         //socketio callbacks
         void on_handshake(message::ptr const& message);
 
@@ -226,7 +548,14 @@ namespace sio
 
         // Connection pointer for client functions.
         connection_hdl m_con;
+        // Latest connection, expires once websocketpp holds no more handlers of it.
+        connection_hdl m_live_con;
         client_type m_client;
+        // Allocates outgoing messages, so frames can be flagged before they are queued.
+        std::shared_ptr<con_msg_manager_type> m_msg_manager;
+
+        // Masking keys of prepared frames.
+        std::random_device m_mask_rng;
         // Socket.IO server settings
 
         std::string m_base_url;
@@ -243,6 +572,33 @@ namespace sio
         std::unique_ptr<asio::steady_timer> m_ping_timeout_timer;
 
         std::unique_ptr<asio::steady_timer> m_reconn_timer;
+
+        // Waiting for the last handler of a closed connection, network thread only.
+        std::vector<std::function<void()> > m_idle_listeners;
+
+        std::unique_ptr<asio::steady_timer> m_idle_timer;
+
+        // Bounds the close handshake run by a polled client's finish_close.
+        std::unique_ptr<asio::steady_timer> m_close_timer;
+
+        // Events waiting for room in the transport buffer, per namespace, network thread only.
+        bulk_lanes<outbound_frame> m_bulk_lanes;
+
+        // A write completed, the release of the lanes and the watermark check are queued.
+        bool m_written_posted = false;
+
+#if SIO_DEFLATE
+        // permessage-deflate is active on the current connection, network thread only.
+        bool m_deflate_negotiated = false;
+#endif
+
+        // Masked frames batched into a single write by set_write_coalescing and cork, network thread only.
+        std::unique_ptr<write_batch> m_batch;
+
+        // Frames behind one being decoded on m_decode_pool, delivered in arrival order, network thread only.
+        std::deque<std::shared_ptr<inbound_frame> > m_inbound;
+
+        std::unique_ptr<worker_pool> m_decode_pool;
         
     };
 
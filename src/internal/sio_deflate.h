@@ -0,0 +1,119 @@
+//
+//  sio_deflate.h
+//
+//  permessage-deflate on the websocket transport, requires zlib.
+//
+
+#ifndef SIO_DEFLATE_H
+#define SIO_DEFLATE_H
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+#include <websocketpp/http/response.hpp>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+namespace sio
+{
+    // Settings websocketpp's permessage-deflate extension reads from the client config.
+    struct permessage_deflate_config
+    {
+        typedef websocketpp::http::parser::request request_type;
+
+        // Honour a server asking us to reset the compression context after each message.
+        static const bool allow_disabling_context_takeover = true;
+
+        // Smallest window the server may ask our compressor to use, 8 accepts any.
+        static const uint8_t minimum_outgoing_window_bits = 8;
+    };
+
+    // websocketpp's extension, negotiating the server's answer and compressing once it is accepted.
+    // Its own offer is fixed and would replace the request header, so it leaves the offer to the client, see deflate_offer.
+    class deflate_extension : public websocketpp::extensions::permessage_deflate::enabled<permessage_deflate_config>
+    {
+    public:
+        std::string generate_offer() const
+        {
+            return std::string();
+        }
+    };
+
+    // Parameters of the extension as accepted by the server.
+    struct deflate_negotiation
+    {
+        deflate_negotiation():
+            enabled(false),
+            server_max_window_bits(15),
+            client_max_window_bits(15),
+            server_no_context_takeover(false),
+            client_no_context_takeover(false)
+        {
+        }
+
+        bool enabled;
+        unsigned server_max_window_bits;
+        unsigned client_max_window_bits;
+        bool server_no_context_takeover;
+        bool client_no_context_takeover;
+    };
+
+    // Offer asking the server to compress with window_bits (8-15), and without context takeover to reset its context after each message.
+    inline std::string deflate_offer(unsigned window_bits, bool context_takeover)
+    {
+        std::ostringstream offer;
+        offer<<"permessage-deflate; client_max_window_bits";
+        if(window_bits < 15)
+        {
+            offer<<"; server_max_window_bits="<<window_bits;
+        }
+        if(!context_takeover)
+        {
+            offer<<"; server_no_context_takeover";
+        }
+        return offer.str();
+    }
+
+    // The server's Sec-WebSocket-Extensions answer, parsed and negotiated by websocketpp the way it did for the connection:
+    // the first permessage-deflate element its extension accepts is the one in use.
+    inline deflate_negotiation negotiate_deflate(std::string const& response_header)
+    {
+        deflate_negotiation result;
+        websocketpp::http::parser::response response;
+        websocketpp::http::parameter_list extensions;
+        response.replace_header("Sec-WebSocket-Extensions", response_header);
+        if(response_header.empty() || response.get_header_as_plist("Sec-WebSocket-Extensions", extensions))
+        {
+            return result;
+        }
+        for(auto it = extensions.begin(); it != extensions.end(); ++it)
+        {
+            deflate_extension extension;
+            if(it->first != "permessage-deflate" || extension.negotiate(it->second).first)
+            {
+                continue;
+            }
+            result.enabled = true;
+            for(auto attr = it->second.begin(); attr != it->second.end(); ++attr)
+            {
+                if(attr->first == "server_max_window_bits" && !attr->second.empty())
+                {
+                    result.server_max_window_bits = (unsigned)atoi(attr->second.c_str());
+                }
+                else if(attr->first == "client_max_window_bits" && !attr->second.empty())
+                {
+                    result.client_max_window_bits = (unsigned)atoi(attr->second.c_str());
+                }
+                else if(attr->first == "server_no_context_takeover")
+                {
+                    result.server_no_context_takeover = true;
+                }
+                else if(attr->first == "client_no_context_takeover")
+                {
+                    result.client_no_context_takeover = true;
+                }
+            }
+            break;
+        }
+        return result;
+    }
+}
+#endif // SIO_DEFLATE_H
@@ -0,0 +1,103 @@
+//
+//  sio_dispatcher.cpp
+//
+
+#include "sio_dispatcher.h"
+
+namespace sio
+{
+    //tasks run for one key before the executor gets a chance to run other keys.
+    static const size_t kSERIAL_BATCH = 32;
+
+    worker_pool::worker_pool(unsigned threads):
+        m_stopping(false)
+    {
+        for (unsigned i = 0; i < threads; ++i) {
+            m_threads.push_back(std::thread(std::bind(&worker_pool::run, this)));
+        }
+    }
+
+    worker_pool::~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+            it->join();
+        }
+    }
+
+    void worker_pool::submit(dispatch_task const& task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_tasks.push_back(task);
+        }
+        m_cond.notify_one();
+    }
+
+    void worker_pool::run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            while (m_tasks.empty() && !m_stopping) {
+                m_cond.wait(lock);
+            }
+            if (m_tasks.empty()) {
+                return;
+            }
+            dispatch_task task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    serial_dispatcher::serial_dispatcher(dispatch_executor const& executor):
+        m_executor(executor)
+    {
+    }
+
+    void serial_dispatcher::post(std::string const& key, dispatch_task const& task)
+    {
+        std::shared_ptr<serial_queue> queue;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            std::shared_ptr<serial_queue>& entry = m_queues[key];
+            if (!entry) {
+                entry = std::make_shared<serial_queue>();
+            }
+            entry->tasks.push_back(task);
+            if (entry->running) {
+                return;
+            }
+            entry->running = true;
+            queue = entry;
+        }
+        m_executor(std::bind(&serial_dispatcher::run, shared_from_this(), key, queue));
+    }
+
+    void serial_dispatcher::run(std::string const& key, std::shared_ptr<serial_queue> const& queue)
+    {
+        for (size_t i = 0; i < kSERIAL_BATCH; ++i) {
+            dispatch_task task;
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                if (queue->tasks.empty()) {
+                    queue->running = false;
+                    //idle keys are forgotten, so per event name ordering does not grow the table forever.
+                    m_queues.erase(key);
+                    return;
+                }
+                task = std::move(queue->tasks.front());
+                queue->tasks.pop_front();
+            }
+            task();
+        }
+        //give other keys a turn, this one stays marked running until it is drained.
+        m_executor(std::bind(&serial_dispatcher::run, shared_from_this(), key, queue));
+    }
+}
@@ -0,0 +1,70 @@
+//
+//  sio_dispatcher.h
+//
+
+#ifndef SIO_DISPATCHER_H
+#define SIO_DISPATCHER_H
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sio
+{
+    typedef std::function<void()> dispatch_task;
+
+    typedef std::function<void(dispatch_task const&)> dispatch_executor;
+
+    // Fixed set of threads running tasks in submission order. Queued tasks still run on destruction.
+    class worker_pool
+    {
+    public:
+        explicit worker_pool(unsigned threads);
+
+        ~worker_pool();
+
+        void submit(dispatch_task const& task);
+
+    private:
+        void run();
+
+        std::vector<std::thread> m_threads;
+        std::deque<dispatch_task> m_tasks;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        bool m_stopping;
+
+        worker_pool(worker_pool const&);
+        void operator=(worker_pool const&);
+    };
+
+    // Runs tasks through an executor, one at a time and in order per key, tasks of different keys in parallel.
+    class serial_dispatcher : public std::enable_shared_from_this<serial_dispatcher>
+    {
+    public:
+        explicit serial_dispatcher(dispatch_executor const& executor);
+
+        void post(std::string const& key, dispatch_task const& task);
+
+    private:
+        struct serial_queue
+        {
+            serial_queue():running(false) {}
+
+            std::deque<dispatch_task> tasks;
+            bool running;
+        };
+
+        void run(std::string const& key, std::shared_ptr<serial_queue> const& queue);
+
+        dispatch_executor m_executor;
+        std::unordered_map<std::string, std::shared_ptr<serial_queue> > m_queues;
+        std::mutex m_mutex;
+    };
+}
+#endif
@@ -0,0 +1,118 @@
+//
+//  sio_message_pool.h
+//
+
+#ifndef SIO_MESSAGE_POOL_H
+#define SIO_MESSAGE_POOL_H
+#include <websocketpp/frame.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sio
+{
+    // Message manager of websocketpp connections that recycles messages and their payload buffers.
+    // Messages are taken on the network thread, but released by whichever thread drops the last reference,
+    // an encode worker or a frame still held by a listener, so the free list is guarded by a mutex.
+    template <typename message>
+    class pooled_msg_manager : public std::enable_shared_from_this<pooled_msg_manager<message> >
+    {
+    public:
+        typedef pooled_msg_manager<message> type;
+        typedef std::shared_ptr<type> ptr;
+        typedef std::weak_ptr<type> weak_ptr;
+        typedef typename message::ptr message_ptr;
+
+        //messages kept for reuse, and the largest payload buffer worth keeping.
+        static const size_t kPOOL_SIZE = 16;
+        static const size_t kPOOLED_CAPACITY = 64 * 1024;
+
+        pooled_msg_manager() {}
+
+        ~pooled_msg_manager()
+        {
+            for (auto it = m_free.begin(); it != m_free.end(); ++it) {
+                delete *it;
+            }
+        }
+
+        message_ptr get_message()
+        {
+            message* msg = take();
+            if (!msg) {
+                msg = new message(this->shared_from_this());
+            }
+            return message_ptr(msg, recycler(this->shared_from_this()));
+        }
+
+        message_ptr get_message(websocketpp::frame::opcode::value op, size_t size)
+        {
+            message* msg = take();
+            if (msg) {
+                msg->set_opcode(op);
+                msg->get_raw_payload().reserve(size);
+            }
+            else {
+                msg = new message(this->shared_from_this(), op, size);
+            }
+            return message_ptr(msg, recycler(this->shared_from_this()));
+        }
+
+        bool recycle(message* msg)
+        {
+            if (msg->get_raw_payload().capacity() > kPOOLED_CAPACITY) {
+                return false;
+            }
+            //keep the payload capacity, reset everything else. The message is no one else's any more.
+            msg->get_raw_payload().clear();
+            msg->set_header(std::string());
+            msg->set_prepared(false);
+            msg->set_compressed(false);
+            msg->set_fin(true);
+            msg->set_terminal(false);
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_free.size() >= kPOOL_SIZE) {
+                return false;
+            }
+            m_free.push_back(msg);
+            return true;
+        }
+
+    private:
+        // Deleter of pooled messages, returns them to their manager while it is alive.
+        struct recycler
+        {
+            explicit recycler(ptr const& manager):manager(manager) {}
+
+            void operator()(message* msg) const
+            {
+                ptr shared = manager.lock();
+                if (!shared || !shared->recycle(msg)) {
+                    delete msg;
+                }
+            }
+
+            weak_ptr manager;
+        };
+
+        message* take()
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_free.empty()) {
+                return NULL;
+            }
+            message* msg = m_free.back();
+            m_free.pop_back();
+            return msg;
+        }
+
+        std::vector<message*> m_free;
+        std::mutex m_mutex;
+
+        pooled_msg_manager(pooled_msg_manager const&);
+        void operator=(pooled_msg_manager const&);
+    };
+}
+
+#endif // SIO_MESSAGE_POOL_H
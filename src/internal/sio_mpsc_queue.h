@@ -0,0 +1,77 @@
+//
+//  sio_mpsc_queue.h
+//
+
+#ifndef SIO_MPSC_QUEUE_H
+#define SIO_MPSC_QUEUE_H
+#include <atomic>
+#include <utility>
+
+namespace sio
+{
+    // Unbounded lock-free queue, any thread may push, a single consumer pops.
+    // Items pushed by one thread are popped in the order they were pushed.
+    template<typename T>
+    class mpsc_queue
+    {
+    public:
+        mpsc_queue():
+            m_head(new node()),
+            m_tail(m_head.load(std::memory_order_relaxed))
+        {
+        }
+
+        ~mpsc_queue()
+        {
+            while (m_tail) {
+                node* next = m_tail->next.load(std::memory_order_relaxed);
+                delete m_tail;
+                m_tail = next;
+            }
+        }
+
+        void push(T&& value)
+        {
+            node* n = new node(std::move(value));
+            node* prev = m_head.exchange(n, std::memory_order_acq_rel);
+            //until this store, the consumer sees the queue ending at prev.
+            prev->next.store(n, std::memory_order_release);
+        }
+
+        //consumer only.
+        bool pop(T& value)
+        {
+            node* next = m_tail->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+            value = std::move(next->value);
+            delete m_tail;
+            m_tail = next;
+            return true;
+        }
+
+        //consumer only.
+        bool empty() const
+        {
+            return m_tail->next.load(std::memory_order_acquire) == nullptr;
+        }
+
+    private:
+        struct node
+        {
+            node():next(nullptr) {}
+            explicit node(T&& v):next(nullptr),value(std::move(v)) {}
+
+            std::atomic<node*> next;
+            T value;
+        };
+
+        std::atomic<node*> m_head;
+        node* m_tail;
+
+        mpsc_queue(mpsc_queue const&);
+        void operator=(mpsc_queue const&);
+    };
+}
+#endif
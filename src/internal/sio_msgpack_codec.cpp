@@ -0,0 +1,454 @@
+//
+//  sio_msgpack_codec.cpp
+//
+
+#include "sio_msgpack_codec.h"
+#include "sio_string_view.h"
+#include <cstring>
+#include <cassert>
+
+namespace sio
+{
+    using namespace std;
+
+    static void put_uint(string& out, uint64_t value, int bytes)
+    {
+        //msgpack is big endian.
+        for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+            out.push_back((char)((value >> shift) & 0xff));
+        }
+    }
+
+    static void put_int(string& out, int64_t value)
+    {
+        if (value >= 0) {
+            if (value < 0x80) {
+                out.push_back((char)value);
+            } else if (value <= 0xff) {
+                out.push_back((char)0xcc);
+                put_uint(out, (uint64_t)value, 1);
+            } else if (value <= 0xffff) {
+                out.push_back((char)0xcd);
+                put_uint(out, (uint64_t)value, 2);
+            } else if (value <= 0xffffffffLL) {
+                out.push_back((char)0xce);
+                put_uint(out, (uint64_t)value, 4);
+            } else {
+                out.push_back((char)0xcf);
+                put_uint(out, (uint64_t)value, 8);
+            }
+        } else {
+            if (value >= -32) {
+                out.push_back((char)(0xe0 | (value + 32)));
+            } else if (value >= -128) {
+                out.push_back((char)0xd0);
+                put_uint(out, (uint64_t)value, 1);
+            } else if (value >= -32768) {
+                out.push_back((char)0xd1);
+                put_uint(out, (uint64_t)value, 2);
+            } else if (value >= -2147483648LL) {
+                out.push_back((char)0xd2);
+                put_uint(out, (uint64_t)value, 4);
+            } else {
+                out.push_back((char)0xd3);
+                put_uint(out, (uint64_t)value, 8);
+            }
+        }
+    }
+
+    static void put_double(string& out, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        out.push_back((char)0xcb);
+        put_uint(out, bits, 8);
+    }
+
+    static void put_str(string& out, const char* data, size_t length)
+    {
+        if (length < 32) {
+            out.push_back((char)(0xa0 | length));
+        } else if (length <= 0xff) {
+            out.push_back((char)0xd9);
+            put_uint(out, length, 1);
+        } else if (length <= 0xffff) {
+            out.push_back((char)0xda);
+            put_uint(out, length, 2);
+        } else {
+            out.push_back((char)0xdb);
+            put_uint(out, length, 4);
+        }
+        out.append(data, length);
+    }
+
+    static void put_bin(string& out, string const& bin)
+    {
+        size_t length = bin.size();
+        if (length <= 0xff) {
+            out.push_back((char)0xc4);
+            put_uint(out, length, 1);
+        } else if (length <= 0xffff) {
+            out.push_back((char)0xc5);
+            put_uint(out, length, 2);
+        } else {
+            out.push_back((char)0xc6);
+            put_uint(out, length, 4);
+        }
+        out.append(bin);
+    }
+
+    static void put_container(string& out, size_t size, unsigned char fix, unsigned char marker16)
+    {
+        //marker32 always follows marker16.
+        if (size < 16) {
+            out.push_back((char)(fix | size));
+        } else if (size <= 0xffff) {
+            out.push_back((char)marker16);
+            put_uint(out, size, 2);
+        } else {
+            out.push_back((char)(marker16 + 1));
+            put_uint(out, size, 4);
+        }
+    }
+
+    static void put_message(string& out, message const& msg)
+    {
+        switch(msg.get_flag())
+        {
+        case message::flag_integer:
+            put_int(out, msg.get_int());
+            break;
+        case message::flag_double:
+            put_double(out, msg.get_double());
+            break;
+        case message::flag_string:
+        {
+            string_message const& str = static_cast<string_message const&>(msg);
+            put_str(out, str.data(), str.length());
+            break;
+        }
+        case message::flag_boolean:
+            out.push_back(msg.get_bool() ? (char)0xc3 : (char)0xc2);
+            break;
+        case message::flag_null:
+            out.push_back((char)0xc0);
+            break;
+        case message::flag_binary:
+            if (msg.get_binary()) {
+                put_bin(out, *msg.get_binary());
+            } else {
+                out.push_back((char)0xc0);
+            }
+            break;
+        case message::flag_array:
+        {
+            put_container(out, msg.get_vector().size(), 0x90, 0xdc);
+            for (vector<message::ptr>::const_iterator it = msg.get_vector().begin(); it!=msg.get_vector().end(); ++it) {
+                if (*it) {
+                    put_message(out, *(*it));
+                } else {
+                    out.push_back((char)0xc0);
+                }
+            }
+            break;
+        }
+        case message::flag_object:
+        {
+            put_container(out, msg.get_map().size(), 0x80, 0xde);
+            for (map<string,message::ptr>::const_iterator it = msg.get_map().begin(); it!= msg.get_map().end(); ++it) {
+                put_str(out, it->first.data(), it->first.size());
+                if (it->second) {
+                    put_message(out, *(it->second));
+                } else {
+                    out.push_back((char)0xc0);
+                }
+            }
+            break;
+        }
+        default:
+            out.push_back((char)0xc0);
+            break;
+        }
+    }
+
+    bool msgpack_codec::encode(packet& pack,string& payload,vector<shared_ptr<const string> >&) const
+    {
+        assert(pack.get_frame() == packet::frame_message);
+        //msgpack carries binary inline, so events and acks are never of the binary kind.
+        pack._type = pack._type&(~packet::type_undetermined);
+        bool hasMessage = !!pack._message;
+        bool hasId = pack._pack_id >= 0;
+        put_container(payload, 2 + (hasMessage ? 1 : 0) + (hasId ? 1 : 0), 0x80, 0xde);
+        put_str(payload, "type", 4);
+        put_int(payload, pack._type);
+        put_str(payload, "nsp", 3);
+        string const& nsp = pack._nsp.empty() ? string("/") : pack._nsp;
+        put_str(payload, nsp.data(), nsp.size());
+        if (hasMessage) {
+            put_str(payload, "data", 4);
+            put_message(payload, *pack._message);
+        }
+        if (hasId) {
+            put_str(payload, "id", 2);
+            put_int(payload, pack._pack_id);
+        }
+        return true;
+    }
+
+    void msgpack_codec::prepare(message const& msg,prepared_body& body) const
+    {
+        put_message(body.data, msg);
+    }
+
+    bool msgpack_codec::encode_prepared(packet& pack,prepared_body const& body,string& payload,vector<shared_ptr<const string> >&) const
+    {
+        pack._type = packet::type_event;
+        bool hasId = pack._pack_id >= 0;
+        payload.reserve(pack._nsp.size() + body.data.size() + 24);
+        put_container(payload, hasId ? 4 : 3, 0x80, 0xde);
+        put_str(payload, "type", 4);
+        put_int(payload, pack._type);
+        put_str(payload, "nsp", 3);
+        string const& nsp = pack._nsp.empty() ? string("/") : pack._nsp;
+        put_str(payload, nsp.data(), nsp.size());
+        put_str(payload, "data", 4);
+        payload.append(body.data);
+        if (hasId) {
+            put_str(payload, "id", 2);
+            put_int(payload, pack._pack_id);
+        }
+        return true;
+    }
+
+    bool msgpack_codec::is_binary_packet(string const& payload) const
+    {
+        if (payload.empty()) {
+            return false;
+        }
+        unsigned char c = (unsigned char)payload[0];
+        return (c & 0xf0) == 0x80 || c == 0xde || c == 0xdf;
+    }
+
+    // Reads msgpack values from a frame, strings either copied or referring into the frame.
+    class msgpack_reader
+    {
+    public:
+        // Arrays and maps nested deeper fail the frame, rather than the stack of the network thread.
+        static const unsigned kMAX_DEPTH = 64;
+
+        msgpack_reader(shared_ptr<string> const& frame,bool insitu):
+            m_frame(frame),
+            m_data((const unsigned char*)frame->data()),
+            m_size(frame->size()),
+            m_pos(0),
+            m_depth(0),
+            m_insitu(insitu),
+            m_ok(true)
+        {
+        }
+
+        bool ok() const
+        {
+            return m_ok;
+        }
+
+        message::ptr read()
+        {
+            if (!require(1)) {
+                return message::ptr();
+            }
+            unsigned char c = m_data[m_pos++];
+            if (c < 0x80) {
+                return int_message::create(c);
+            }
+            if (c >= 0xe0) {
+                return int_message::create((int8_t)c);
+            }
+            if ((c & 0xf0) == 0x80) {
+                return read_map(c & 0x0f);
+            }
+            if ((c & 0xf0) == 0x90) {
+                return read_array(c & 0x0f);
+            }
+            if ((c & 0xe0) == 0xa0) {
+                return read_str(c & 0x1f);
+            }
+            switch (c) {
+            case 0xc0: return null_message::create();
+            case 0xc2: return bool_message::create(false);
+            case 0xc3: return bool_message::create(true);
+            case 0xc4: return read_bin(read_uint(1));
+            case 0xc5: return read_bin(read_uint(2));
+            case 0xc6: return read_bin(read_uint(4));
+            case 0xca:
+            {
+                uint32_t bits = (uint32_t)read_uint(4);
+                float value;
+                memcpy(&value, &bits, sizeof(value));
+                return double_message::create(value);
+            }
+            case 0xcb:
+            {
+                uint64_t bits = read_uint(8);
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                return double_message::create(value);
+            }
+            case 0xcc: return int_message::create((int64_t)read_uint(1));
+            case 0xcd: return int_message::create((int64_t)read_uint(2));
+            case 0xce: return int_message::create((int64_t)read_uint(4));
+            case 0xcf: return int_message::create((int64_t)read_uint(8));
+            case 0xd0: return int_message::create((int8_t)read_uint(1));
+            case 0xd1: return int_message::create((int16_t)read_uint(2));
+            case 0xd2: return int_message::create((int32_t)read_uint(4));
+            case 0xd3: return int_message::create((int64_t)read_uint(8));
+            case 0xd9: return read_str(read_uint(1));
+            case 0xda: return read_str(read_uint(2));
+            case 0xdb: return read_str(read_uint(4));
+            case 0xdc: return read_array(read_uint(2));
+            case 0xdd: return read_array(read_uint(4));
+            case 0xde: return read_map(read_uint(2));
+            case 0xdf: return read_map(read_uint(4));
+            default:
+                //extension types are not supported.
+                m_ok = false;
+                return message::ptr();
+            }
+        }
+
+    private:
+        bool require(uint64_t count)
+        {
+            if (!m_ok || count > m_size - m_pos) {
+                m_ok = false;
+                return false;
+            }
+            return true;
+        }
+
+        uint64_t read_uint(int bytes)
+        {
+            if (!require(bytes)) {
+                return 0;
+            }
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; ++i) {
+                value = (value << 8) | m_data[m_pos++];
+            }
+            return value;
+        }
+
+        message::ptr read_str(uint64_t length)
+        {
+            if (!require(length)) {
+                return message::ptr();
+            }
+            const char* data = (const char*)m_data + m_pos;
+            m_pos += (size_t)length;
+            if (m_insitu) {
+                return string_view_message::create(m_frame, data, (size_t)length);
+            }
+            return string_message::create(string(data, (size_t)length));
+        }
+
+        message::ptr read_bin(uint64_t length)
+        {
+            if (!require(length)) {
+                return message::ptr();
+            }
+            const char* data = (const char*)m_data + m_pos;
+            m_pos += (size_t)length;
+            return binary_message::create(make_shared<const string>(data, (size_t)length));
+        }
+
+        bool enter()
+        {
+            if (m_depth >= kMAX_DEPTH) {
+                m_ok = false;
+                return false;
+            }
+            m_depth++;
+            return true;
+        }
+
+        message::ptr read_array(uint64_t size)
+        {
+            if (!enter()) {
+                return message::ptr();
+            }
+            message::ptr arr = array_message::create();
+            for (uint64_t i = 0; i < size && m_ok; ++i) {
+                arr->get_vector().push_back(read());
+            }
+            m_depth--;
+            return arr;
+        }
+
+        message::ptr read_map(uint64_t size)
+        {
+            if (!enter()) {
+                return message::ptr();
+            }
+            message::ptr obj = object_message::create();
+            for (uint64_t i = 0; i < size && m_ok; ++i) {
+                message::ptr key = read();
+                message::ptr value = read();
+                if (key && key->get_flag() == message::flag_string) {
+                    obj->get_map()[key->get_string()] = value;
+                }
+            }
+            m_depth--;
+            return obj;
+        }
+
+        shared_ptr<string> m_frame;
+        const unsigned char* m_data;
+        size_t m_size;
+        size_t m_pos;
+        unsigned m_depth;
+        bool m_insitu;
+        bool m_ok;
+    };
+
+    bool msgpack_codec::decode(packet& pack,shared_ptr<string> const& payload,bool insitu) const
+    {
+        msgpack_reader reader(payload, insitu);
+        message::ptr root = reader.read();
+        pack._frame = packet::frame_message;
+        pack._type = packet::type_error;
+        pack._nsp = "/";
+        pack._pack_id = -1;
+        pack._message.reset();
+        if (!reader.ok() || !root || root->get_flag() != message::flag_object) {
+            return false;
+        }
+        map<string,message::ptr> const& fields = root->get_map();
+        auto it = fields.find("type");
+        if (it != fields.end() && it->second && it->second->get_flag() == message::flag_integer) {
+            int64_t type = it->second->get_int();
+            if (type >= packet::type_min && type <= packet::type_max) {
+                pack._type = (int)type;
+            }
+        }
+        it = fields.find("nsp");
+        if (it != fields.end() && it->second && it->second->get_flag() == message::flag_string) {
+            pack._nsp = it->second->get_string();
+        }
+        it = fields.find("id");
+        if (it != fields.end() && it->second && it->second->get_flag() == message::flag_integer) {
+            pack._pack_id = (int)it->second->get_int();
+        }
+        it = fields.find("data");
+        if (it != fields.end()) {
+            pack._message = it->second;
+        }
+        if ((pack._type == packet::type_event || pack._type == packet::type_binary_event) &&
+            pack._message && pack._message->get_flag() == message::flag_array &&
+            pack._message->get_vector().size() > 0 && pack._message->get_vector()[0] &&
+            pack._message->get_vector()[0]->get_flag() == message::flag_string) {
+            pack._has_event_name = true;
+            pack._event_name = pack._message->get_vector()[0]->get_string();
+        }
+        return false;
+    }
+}
@@ -0,0 +1,27 @@
+//
+//  sio_msgpack_codec.h
+//
+
+#ifndef SIO_MSGPACK_CODEC_H
+#define SIO_MSGPACK_CODEC_H
+#include "sio_packet.h"
+
+namespace sio
+{
+    // Encoding of socket.io-msgpack-parser: each packet is a single msgpack map {type, nsp, data, id}
+    // sent as one binary frame, binary data included.
+    class msgpack_codec : public packet_codec
+    {
+    public:
+        bool encode(packet& pack,string& payload,vector<shared_ptr<const string> >& buffers) const;
+
+        bool is_binary_packet(string const& payload) const;
+
+        bool decode(packet& pack,shared_ptr<string> const& payload,bool insitu) const;
+
+        void prepare(message const& msg,prepared_body& body) const;
+
+        bool encode_prepared(packet& pack,prepared_body const& body,string& payload,vector<shared_ptr<const string> >& buffers) const;
+    };
+}
+#endif
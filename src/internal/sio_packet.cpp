@@ -5,10 +5,12 @@
 //
 
 #include "sio_packet.h"
-#include <rapidjson/document.h>
+#include "sio_string_view.h"
 #include <rapidjson/encodedstream.h>
 #include <rapidjson/writer.h>
+#include <rapidjson/reader.h>
 #include <cassert>
+#include <algorithm>
 
 #define kBIN_PLACE_HOLDER "_placeholder"
 
@@ -16,111 +18,258 @@ namespace sio
 {
     using namespace rapidjson;
     using namespace std;
-    void accept_message(message const& msg,Value& val, Document& doc,vector<shared_ptr<const string> >& buffers);
 
-	void accept_bool_message(bool_message const& msg, Value& val)
-	{
-		val.SetBool(msg.get_bool());
-	}
+    // SAX handler building the message tree while rapidjson parses, with no intermediate Document.
+    class message_builder
+    {
+    public:
+        typedef char Ch;
+
+        //when frame is set, strings parsed in situ point into frame instead of being copied.
+        message_builder(vector<shared_ptr<const string> > const& buffers, shared_ptr<const string> const& frame, bool resolve_placeholders):
+            m_buffers(buffers),
+            m_frame(frame),
+            m_resolve_placeholders(resolve_placeholders)
+        {
+        }
 
-	void accept_null_message(Value& val)
-	{
-		val.SetNull();
-	}
+        bool Null() { return add(null_message::create()); }
 
-    void accept_int_message(int_message const& msg, Value& val)
-    {
-        val.SetInt64(msg.get_int());
-    }
+        bool Bool(bool b) { return add(bool_message::create(b)); }
 
-    void accept_double_message(double_message const& msg, Value& val)
-    {
-        val.SetDouble(msg.get_double());
-    }
+        bool Int(int i) { return add(int_message::create(i)); }
 
-    void accept_string_message(string_message const& msg, Value& val)
-    {
-        val.SetString(msg.get_string().data(),(SizeType) msg.get_string().length());
-    }
+        bool Uint(unsigned u) { return add(int_message::create(u)); }
+
+        bool Int64(int64_t i) { return add(int_message::create(i)); }
+
+        bool Uint64(uint64_t u) { return add(int_message::create(static_cast<int64_t>(u))); }
+
+        bool Double(double d) { return add(double_message::create(d)); }
+
+        bool RawNumber(const Ch*, SizeType, bool) { return false; } //only produced with kParseNumbersAsStringsFlag.
+
+        bool String(const Ch* str, SizeType length, bool copy)
+        {
+            if(m_frame && !copy)
+            {
+                return add(string_view_message::create(m_frame, str, length));
+            }
+            return add(string_message::create(string(str, length)));
+        }
+
+        bool StartObject()
+        {
+            m_stack.push_back(object_message::create());
+            return true;
+        }
+
+        bool Key(const Ch* str, SizeType length, bool)
+        {
+            m_keys.push_back(string(str, length));
+            return true;
+        }
+
+        bool EndObject(SizeType)
+        {
+            message::ptr obj = std::move(m_stack.back());
+            m_stack.pop_back();
+            if(m_resolve_placeholders)
+            {
+                return add(resolve_placeholder(std::move(obj)));
+            }
+            return add(std::move(obj));
+        }
+
+        bool StartArray()
+        {
+            m_stack.push_back(array_message::create());
+            return true;
+        }
+
+        bool EndArray(SizeType)
+        {
+            message::ptr arr = std::move(m_stack.back());
+            m_stack.pop_back();
+            return add(std::move(arr));
+        }
+
+        message::ptr const& get_root() const
+        {
+            return m_root;
+        }
+
+    private:
+        bool add(message::ptr value)
+        {
+            if(m_stack.empty())
+            {
+                m_root = std::move(value);
+            }
+            else if(m_stack.back()->get_flag() == message::flag_array)
+            {
+                m_stack.back()->get_vector().push_back(std::move(value));
+            }
+            else
+            {
+                m_stack.back()->get_map()[std::move(m_keys.back())] = std::move(value);
+                m_keys.pop_back();
+            }
+            return true;
+        }
+
+        message::ptr resolve_placeholder(message::ptr obj) const
+        {
+            map<string,message::ptr> const& members = obj->get_map();
+            auto mem_it = members.find(kBIN_PLACE_HOLDER);
+            if(mem_it == members.end() || !mem_it->second || mem_it->second->get_flag() != message::flag_boolean || !mem_it->second->get_bool())
+            {
+                return obj;
+            }
+            auto num_it = members.find("num");
+            if(num_it != members.end() && num_it->second && num_it->second->get_flag() == message::flag_integer)
+            {
+                int64_t num = num_it->second->get_int();
+                if(num >= 0 && num < static_cast<int64_t>(m_buffers.size()))
+                {
+                    return binary_message::create(m_buffers[(size_t)num]);
+                }
+            }
+            return message::ptr();
+        }
 
+        vector<shared_ptr<const string> > const& m_buffers;
+        shared_ptr<const string> m_frame;
+        bool m_resolve_placeholders;
+        vector<message::ptr> m_stack;
+        vector<string> m_keys;
+        message::ptr m_root;
+    };
 
-    void accept_binary_message(binary_message const& msg,Value& val,Document& doc,vector<shared_ptr<const string> >& buffers)
+    message::ptr build_message(const char* json, vector<shared_ptr<const string> > const& buffers, bool resolve_placeholders)
     {
-        val.SetObject();
-        Value boolVal;
-        boolVal.SetBool(true);
-        val.AddMember(kBIN_PLACE_HOLDER, boolVal, doc.GetAllocator());
-        Value numVal;
-        numVal.SetInt((int)buffers.size());
-        val.AddMember("num", numVal, doc.GetAllocator());
-        buffers.push_back(msg.get_binary());
+        message_builder builder(buffers, shared_ptr<const string>(), resolve_placeholders);
+        StringStream stream(json);
+        Reader reader;
+        if(reader.Parse<kParseDefaultFlags>(stream, builder).IsError())
+        {
+            //an unparsable body decodes to null, the way callers always saw it.
+            return null_message::create();
+        }
+        return builder.get_root();
     }
 
-    void accept_array_message(array_message const& msg,Value& val,Document& doc,vector<shared_ptr<const string> >& buffers)
+    message::ptr build_message_insitu(shared_ptr<string> const& frame, size_t json_pos, vector<shared_ptr<const string> > const& buffers, bool resolve_placeholders)
     {
-        val.SetArray();
-        for (vector<message::ptr>::const_iterator it = msg.get_vector().begin(); it!=msg.get_vector().end(); ++it) {
-            Value child;
-            accept_message(*(*it), child, doc,buffers);
-            val.PushBack(child, doc.GetAllocator());
+        message_builder builder(buffers, frame, resolve_placeholders);
+        InsituStringStream stream(&(*frame)[json_pos]);
+        Reader reader;
+        if(reader.Parse<kParseInsituFlag>(stream, builder).IsError())
+        {
+            return null_message::create();
         }
+        return builder.get_root();
     }
 
-    void accept_object_message(object_message const& msg,Value& val,Document& doc,vector<shared_ptr<const string> >& buffers)
+    // rapidjson output stream writing straight into the packet payload,
+    // so the encoded JSON never goes through an intermediate buffer.
+    class payload_stream
     {
-        val.SetObject();
-        for (map<string,message::ptr>::const_iterator it = msg.get_map().begin(); it!= msg.get_map().end(); ++it) {
-            Value nameVal;
-            nameVal.SetString(it->first.data(), (SizeType)it->first.length(), doc.GetAllocator());
-            Value valueVal;
-            accept_message(*(it->second), valueVal, doc,buffers);
-            val.AddMember(nameVal, valueVal, doc.GetAllocator());
+    public:
+        typedef char Ch;
+
+        payload_stream(string& payload):m_payload(payload)
+        {
+        }
+
+        void Put(Ch c)
+        {
+            m_payload.push_back(c);
+        }
+
+        void Reserve(size_t count)
+        {
+            size_t required = m_payload.size() + count;
+            if(required > m_payload.capacity())
+            {
+                //grow geometrically, reserve() alone would reallocate on every string.
+                m_payload.reserve(std::max(required, m_payload.capacity() * 2));
+            }
         }
+
+        void Flush()
+        {
+        }
+
+    private:
+        string& m_payload;
+    };
+}
+
+namespace rapidjson
+{
+    template<>
+    inline void PutReserve(sio::payload_stream& stream, size_t count)
+    {
+        stream.Reserve(count);
     }
+}
 
-    void accept_message(message const& msg,Value& val, Document& doc,vector<shared_ptr<const string> >& buffers)
+namespace sio
+{
+    typedef Writer<payload_stream> payload_writer;
+
+    void write_message(message const& msg, payload_writer& writer, vector<shared_ptr<const string> >& buffers)
     {
         const message* msg_ptr = &msg;
         switch(msg.get_flag())
         {
         case message::flag_integer:
-        {
-            accept_int_message(*(static_cast<const int_message*>(msg_ptr)), val);
+            writer.Int64(msg.get_int());
             break;
-        }
         case message::flag_double:
-        {
-            accept_double_message(*(static_cast<const double_message*>(msg_ptr)), val);
+            writer.Double(msg.get_double());
             break;
-        }
         case message::flag_string:
         {
-            accept_string_message(*(static_cast<const string_message*>(msg_ptr)), val);
+            string_message const& str = static_cast<string_message const&>(msg);
+            writer.String(str.data(), (SizeType)str.length());
             break;
         }
-		case message::flag_boolean:
-		{
-			accept_bool_message(*(static_cast<const bool_message*>(msg_ptr)), val);
-			break;
-		}
-		case message::flag_null:
-		{
-			accept_null_message(val);
-			break;
-		}
+        case message::flag_boolean:
+            writer.Bool(msg.get_bool());
+            break;
+        case message::flag_null:
+            writer.Null();
+            break;
         case message::flag_binary:
         {
-            accept_binary_message(*(static_cast<const binary_message*>(msg_ptr)), val,doc,buffers);
+            writer.StartObject();
+            writer.String(kBIN_PLACE_HOLDER, (SizeType)(sizeof(kBIN_PLACE_HOLDER) - 1));
+            writer.Bool(true);
+            writer.String("num", 3);
+            writer.Int((int)buffers.size());
+            writer.EndObject();
+            buffers.push_back(static_cast<const binary_message*>(msg_ptr)->get_binary());
             break;
         }
         case message::flag_array:
         {
-            accept_array_message(*(static_cast<const array_message*>(msg_ptr)), val,doc,buffers);
+            writer.StartArray();
+            for (vector<message::ptr>::const_iterator it = msg.get_vector().begin(); it!=msg.get_vector().end(); ++it) {
+                write_message(*(*it), writer, buffers);
+            }
+            writer.EndArray();
             break;
         }
         case message::flag_object:
         {
-            accept_object_message(*(static_cast<const object_message*>(msg_ptr)), val,doc,buffers);
+            writer.StartObject();
+            for (map<string,message::ptr>::const_iterator it = msg.get_map().begin(); it!= msg.get_map().end(); ++it) {
+                writer.String(it->first.data(), (SizeType)it->first.length());
+                write_message(*(it->second), writer, buffers);
+            }
+            writer.EndObject();
             break;
         }
         default:
@@ -128,67 +277,41 @@ namespace sio
         }
     }
 
-    message::ptr from_json(Value const& value, vector<shared_ptr<const string> > const& buffers)
+    size_t count_binaries(message const& msg)
     {
-        if(value.IsInt64())
-        {
-            return int_message::create(value.GetInt64());
-        }
-        else if (value.IsUint64())
-        {
-          return int_message::create(static_cast<int64_t>(value.GetUint64()));
-        }
-        else if(value.IsDouble())
-        {
-            return double_message::create(value.GetDouble());
-        }
-        else if(value.IsString())
-        {
-            string str(value.GetString(),value.GetStringLength());
-            return string_message::create(str);
-        }
-        else if(value.IsArray())
-        {
-            message::ptr ptr = array_message::create();
-            for (SizeType i = 0; i< value.Size(); ++i) {
-                static_cast<array_message*>(ptr.get())->get_vector().push_back(from_json(value[i],buffers));
-            }
-            return ptr;
-        }
-        else if(value.IsObject())
+        size_t count = 0;
+        switch(msg.get_flag())
         {
-            //binary placeholder
-            auto mem_it = value.FindMember(kBIN_PLACE_HOLDER);
-            if (mem_it!=value.MemberEnd() && mem_it->value.GetBool()) {
-
-                int num = value["num"].GetInt();
-                if(num >= 0 && num < static_cast<int>(buffers.size()))
-                {
-                    return binary_message::create(buffers[num]);
-                }
-                return message::ptr();
+        case message::flag_binary:
+            count = 1;
+            break;
+        case message::flag_array:
+            for (vector<message::ptr>::const_iterator it = msg.get_vector().begin(); it!=msg.get_vector().end(); ++it) {
+                count += count_binaries(*(*it));
             }
-            //real object message.
-            message::ptr ptr = object_message::create();
-            for (auto it = value.MemberBegin();it!=value.MemberEnd();++it)
-            {
-                if(it->name.IsString())
-                {
-                    string key(it->name.GetString(),it->name.GetStringLength());
-                    static_cast<object_message*>(ptr.get())->get_map()[key] = from_json(it->value,buffers);
-                }
+            break;
+        case message::flag_object:
+            for (map<string,message::ptr>::const_iterator it = msg.get_map().begin(); it!= msg.get_map().end(); ++it) {
+                count += count_binaries(*(it->second));
             }
-            return ptr;
-        }
-        else if(value.IsBool())
-        {
-            return bool_message::create(value.GetBool());
+            break;
+        default:
+            break;
         }
-        else if(value.IsNull())
-        {
-            return null_message::create();
+        return count;
+    }
+
+    void append_uint(string& payload, unsigned value)
+    {
+        char digits[10];
+        size_t len = 0;
+        do {
+            digits[len++] = (char)('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (len > 0) {
+            payload.push_back(digits[--len]);
         }
-        return message::ptr();
     }
 
     packet::packet(string const& nsp,message::ptr const& msg,int pack_id, bool isAck):
@@ -197,7 +320,27 @@ namespace sio
         _nsp(nsp),
         _pack_id(pack_id),
         _message(msg),
-        _pending_buffers(0)
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true)
+    {
+        assert((!isAck
+                || (isAck&&pack_id>=0)));
+    }
+
+    packet::packet(string const& nsp,message::ptr&& msg,int pack_id, bool isAck):
+        _frame(frame_message),
+        _type((isAck?type_ack : type_event) | type_undetermined),
+        _nsp(nsp),
+        _pack_id(pack_id),
+        _message(std::move(msg)),
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true)
     {
         assert((!isAck
                 || (isAck&&pack_id>=0)));
@@ -209,7 +352,27 @@ namespace sio
         _nsp(nsp),
         _pack_id(-1),
         _message(msg),
-        _pending_buffers(0)
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true)
+    {
+
+    }
+
+    packet::packet(string const& nsp,shared_ptr<const prepared_event_impl> const& prepared,int pack_id):
+        _frame(frame_message),
+        _type(type_event | type_undetermined),
+        _nsp(nsp),
+        _pack_id(pack_id),
+        _message(prepared->get_message()),
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true),
+        _prepared(prepared)
     {
 
     }
@@ -218,7 +381,11 @@ namespace sio
         _frame(frame),
         _type(type_undetermined),
         _pack_id(-1),
-        _pending_buffers(0)
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true)
     {
 
     }
@@ -226,7 +393,11 @@ namespace sio
     packet::packet():
         _type(type_undetermined),
         _pack_id(-1),
-        _pending_buffers(0)
+        _pending_buffers(0),
+        _json_pos(0),
+        _insitu(false),
+        _has_event_name(false),
+        _compress(true)
     {
 
     }
@@ -248,44 +419,58 @@ namespace sio
     }
 
     bool packet::parse_buffer(const string &buf_payload)
+    {
+        return parse_buffer(std::make_shared<string>(buf_payload.data(),buf_payload.size()));
+    }
+
+    bool packet::parse_buffer(shared_ptr<const string> const& buf_payload)
     {
         if (_pending_buffers > 0) {
-            assert(is_binary_message(buf_payload));//this is ensured by outside.
-            _buffers.push_back(std::make_shared<string>(buf_payload.data(),buf_payload.size()));
+            assert(is_binary_message(*buf_payload));//this is ensured by outside.
+            _buffers.push_back(buf_payload);
             _pending_buffers--;
-            if (_pending_buffers == 0) {
+            //the body is decoded on demand once all buffers are here.
+            return _pending_buffers > 0;
+        }
+        return false;
+    }
 
-                Document doc;
-                doc.Parse<0>(_buffers.front()->data());
-                _buffers.erase(_buffers.begin());
-                _message = from_json(doc, _buffers);
-                _buffers.clear();
-                return false;
+    static unsigned parse_uint(string const& str, size_t begin, size_t end)
+    {
+        unsigned value = 0;
+        for (size_t i = begin; i < end && i < str.size(); ++i) {
+            if(str[i] < '0' || str[i] > '9')
+            {
+                break;
             }
-            return true;
+            value = value * 10 + (str[i] - '0');
         }
-        return false;
+        return value;
     }
 
-    bool packet::parse(const string& payload_ptr)
+    size_t packet::parse_header(const string& payload_ptr)
     {
         assert(!is_binary_message(payload_ptr)); //this is ensured by outside
         _frame = (packet::frame_type) (payload_ptr[0] - '0');
         _message.reset();
         _pack_id = -1;
         _buffers.clear();
+        _payload.reset();
+        _json_pos = 0;
+        _has_event_name = false;
+        _event_name.clear();
         _pending_buffers = 0;
         size_t pos = 1;
         if (_frame == frame_message) {
             _type = (packet::type)(payload_ptr[pos] - '0');
             if(_type < type_min || _type > type_max)
             {
-                return false;
+                return string::npos;
             }
             pos++;
             if (_type == type_binary_event || _type == type_binary_ack) {
-                size_t score_pos = payload_ptr.find('-');
-                _pending_buffers = static_cast<unsigned>(std::stoul(payload_ptr.substr(pos, score_pos - pos)));
+                size_t score_pos = payload_ptr.find('-', pos);
+                _pending_buffers = parse_uint(payload_ptr, pos, score_pos);
                 pos = score_pos+1;
             }
         }
@@ -294,27 +479,27 @@ namespace sio
         if(nsp_json_pos==string::npos)//no namespace and no message,the end.
         {
             _nsp = "/";
-            return false;
+            return string::npos;
         }
         size_t json_pos = nsp_json_pos;
         if(payload_ptr[nsp_json_pos] == '/')//nsp_json_pos is start of nsp
         {
-            size_t comma_pos = payload_ptr.find_first_of(",");//end of nsp
+            size_t comma_pos = payload_ptr.find(',', nsp_json_pos);//end of nsp
             if(comma_pos == string::npos)//packet end with nsp
             {
-                _nsp = payload_ptr.substr(nsp_json_pos);
-                return false;
+                _nsp.assign(payload_ptr, nsp_json_pos, string::npos);
+                return string::npos;
             }
             else//we have a message, maybe the message have an id.
             {
-                _nsp = payload_ptr.substr(nsp_json_pos,comma_pos - nsp_json_pos);
+                _nsp.assign(payload_ptr, nsp_json_pos, comma_pos - nsp_json_pos);
                 pos = comma_pos+1;//start of the message
                 json_pos = payload_ptr.find_first_of("\"[{", pos, 3);//start of the json part of message
                 if(json_pos == string::npos)
                 {
                     //no message,the end
                     //assume if there's no message, there's no message id.
-                    return false;
+                    return string::npos;
                 }
             }
         }
@@ -325,38 +510,129 @@ namespace sio
 
         if(pos<json_pos)//we've got pack id.
         {
-            _pack_id = std::stoi(payload_ptr.substr(pos,json_pos - pos));
+            _pack_id = (int)parse_uint(payload_ptr, pos, json_pos);
+        }
+        return json_pos;
+    }
+
+    bool packet::parse(const string& payload_ptr)
+    {
+        size_t json_pos = parse_header(payload_ptr);
+        if(json_pos == string::npos)
+        {
+            return false;
+        }
+        _insitu = false;
+        _payload = make_shared<string>(payload_ptr.data() + json_pos, payload_ptr.length() - json_pos);
+        parse_event_name();
+        //parse later when all buffers are arrived.
+        return _pending_buffers > 0;
+    }
+
+    bool packet::parse(shared_ptr<string> const& payload_ptr,bool insitu)
+    {
+        size_t json_pos = parse_header(*payload_ptr);
+        if(json_pos == string::npos)
+        {
+            return false;
         }
-        if (_frame == frame_message && (_type == type_binary_event || _type == type_binary_ack)) {
-            //parse later when all buffers are arrived.
-            _buffers.push_back(make_shared<string>(payload_ptr.data() + json_pos, payload_ptr.length() - json_pos));
+        _insitu = insitu;
+        _payload = payload_ptr;
+        _json_pos = json_pos;
+        parse_event_name();
+        //parse later when all buffers are arrived.
+        return _pending_buffers > 0;
+    }
+
+    // SAX handler accepting the opening bracket of an event array and its first string, then stopping the parse.
+    class event_name_handler : public BaseReaderHandler<UTF8<>, event_name_handler>
+    {
+    public:
+        event_name_handler(string& name):m_name(name),m_found(false),m_in_array(false)
+        {
+        }
+
+        bool StartArray()
+        {
+            if(m_in_array)
+            {
+                return false;
+            }
+            m_in_array = true;
             return true;
         }
-        else
+
+        bool String(const char* str, SizeType length, bool)
         {
-            Document doc;
-            doc.Parse<0>(payload_ptr.data()+json_pos);
-            _message = from_json(doc, vector<shared_ptr<const string> >());
+            if(m_in_array)
+            {
+                m_name.assign(str, length);
+                m_found = true;
+            }
             return false;
         }
 
+        bool Default()
+        {
+            return false;
+        }
+
+        bool found() const
+        {
+            return m_found;
+        }
+
+    private:
+        string& m_name;
+        bool m_found;
+        bool m_in_array;
+    };
+
+    void packet::parse_event_name()
+    {
+        if (_frame != frame_message || (_type != type_event && _type != type_binary_event)) {
+            return;
+        }
+        event_name_handler handler(_event_name);
+        StringStream stream(_payload->data() + _json_pos);
+        Reader reader;
+        reader.Parse<kParseDefaultFlags>(stream, handler);
+        _has_event_name = handler.found();
+    }
+
+    void packet::decode_payload() const
+    {
+        //placeholders only need resolving when the packet carries attachments.
+        bool resolve_placeholders = _frame == frame_message && (_type == type_binary_event || _type == type_binary_ack);
+        if(_insitu)
+        {
+            _message = build_message_insitu(_payload, _json_pos, _buffers, resolve_placeholders);
+        }
+        else
+        {
+            _message = build_message(_payload->data() + _json_pos, _buffers, resolve_placeholders);
+        }
+        _payload.reset();
+        _buffers.clear();
+    }
+
+    message::ptr packet::decode_json(string const& json)
+    {
+        return build_message(json.c_str(), vector<shared_ptr<const string> >(), false);
     }
 
     bool packet::accept(string& payload_ptr, vector<shared_ptr<const string> >&buffers)
     {
         char frame_char = _frame+'0';
-        payload_ptr.append(&frame_char,1);
+        payload_ptr.push_back(frame_char);
         if (_frame!=frame_message) {
             return false;
         }
-        bool hasMessage = false;
-        Document doc;
-        if (_message) {
-            accept_message(*_message, doc, doc, buffers);
-            hasMessage = true;
-        }
-        bool hasBinary = buffers.size()>0;
         _type = _type&(~type_undetermined);
+        bool hasMessage = !!_message;
+        //attachments are counted ahead, so the header goes in once, before the body.
+        size_t binaries = hasMessage ? count_binaries(*_message) : 0;
+        bool hasBinary = binaries > 0;
         if(_type == type_event)
         {
             _type = hasBinary?type_binary_event:type_event;
@@ -365,32 +641,30 @@ namespace sio
         {
             _type = hasBinary? type_binary_ack : type_ack;
         }
-        ostringstream ss;
-        ss.precision(8);
-        ss<<_type;
+        payload_stream stream(payload_ptr);
+        stream.Reserve(_nsp.size() + 16);
+
+        payload_ptr.push_back((char)('0' + _type));
         if (hasBinary) {
-            ss<<buffers.size()<<"-";
+            append_uint(payload_ptr, (unsigned)binaries);
+            payload_ptr.push_back('-');
         }
         if(_nsp.size()>0 && _nsp!="/")
         {
-            ss<<_nsp;
+            payload_ptr.append(_nsp);
             if (hasMessage || _pack_id>=0) {
-                ss<<",";
+                payload_ptr.push_back(',');
             }
         }
-
         if(_pack_id>=0)
         {
-            ss<<_pack_id;
+            append_uint(payload_ptr, (unsigned)_pack_id);
         }
 
-        payload_ptr.append(ss.str());
         if (hasMessage)
         {
-            StringBuffer buffer;
-            Writer<StringBuffer> writer(buffer);
-            doc.Accept(writer);
-            payload_ptr.append(buffer.GetString(),buffer.GetSize());
+            payload_writer writer(stream);
+            write_message(*_message, writer, buffers);
         }
         return hasBinary;
     }
@@ -406,6 +680,13 @@ namespace sio
         return (type)_type;
     }
 
+    bool packet::is_control() const
+    {
+        //events and acks only learn whether they are binary when encoded.
+        int t = _type & (~type_undetermined);
+        return _frame != frame_message || t == type_connect || t == type_ack || t == type_binary_ack;
+    }
+
     string const& packet::get_nsp() const
     {
         return _nsp;
@@ -413,16 +694,51 @@ namespace sio
 
     message::ptr const& packet::get_message() const
     {
+        if(_payload && _pending_buffers == 0)
+        {
+            decode_payload();
+        }
         return _message;
     }
 
+    message::ptr packet::take_message()
+    {
+        get_message();
+        return std::move(_message);
+    }
+
+    bool packet::has_event_name() const
+    {
+        return _has_event_name;
+    }
+
+    string const& packet::get_event_name() const
+    {
+        return _event_name;
+    }
+
+    bool packet::get_compress() const
+    {
+        return _compress;
+    }
+
+    void packet::set_compress(bool compress)
+    {
+        _compress = compress;
+    }
+
+    shared_ptr<const prepared_event_impl> const& packet::get_prepared() const
+    {
+        return _prepared;
+    }
+
     unsigned packet::get_pack_id() const
     {
         return _pack_id;
     }
 
 
-    void packet_manager::set_decode_callback(function<void (packet const&)> const& decode_callback)
+    void packet_manager::set_decode_callback(decode_callback_function const& decode_callback)
     {
         m_decode_callback = decode_callback;
     }
@@ -432,52 +748,221 @@ namespace sio
         m_encode_callback = encode_callback;
     }
 
+    bool json_codec::encode(packet& pack,string& payload,vector<shared_ptr<const string> >& buffers) const
+    {
+        pack.accept(payload,buffers);
+        return false;
+    }
+
+    bool json_codec::is_binary_packet(string const&) const
+    {
+        return false;
+    }
+
+    bool json_codec::decode(packet&,shared_ptr<string> const&,bool) const
+    {
+        //json packets always come as text frames.
+        return false;
+    }
+
+    void json_codec::prepare(message const& msg,prepared_body& body) const
+    {
+        payload_stream stream(body.data);
+        payload_writer writer(stream);
+        write_message(msg, writer, body.buffers);
+    }
+
+    bool json_codec::encode_prepared(packet& pack,prepared_body const& body,string& payload,vector<shared_ptr<const string> >& buffers) const
+    {
+        bool hasBinary = !body.buffers.empty();
+        pack._type = hasBinary ? packet::type_binary_event : packet::type_event;
+        payload.reserve(pack._nsp.size() + body.data.size() + 16);
+        payload.push_back((char)('0' + packet::frame_message));
+        payload.push_back((char)('0' + pack._type));
+        if (hasBinary) {
+            append_uint(payload, (unsigned)body.buffers.size());
+            payload.push_back('-');
+        }
+        if(pack._nsp.size()>0 && pack._nsp!="/")
+        {
+            payload.append(pack._nsp);
+            payload.push_back(',');
+        }
+        if(pack._pack_id>=0)
+        {
+            append_uint(payload, (unsigned)pack._pack_id);
+        }
+        payload.append(body.data);
+        buffers.insert(buffers.end(), body.buffers.begin(), body.buffers.end());
+        return false;
+    }
+
+    prepared_event_impl::prepared_event_impl(string const& name,message::ptr const& msg):
+        m_name(name),
+        m_message(msg)
+    {
+    }
+
+    string const& prepared_event_impl::get_name() const
+    {
+        return m_name;
+    }
+
+    message::ptr const& prepared_event_impl::get_message() const
+    {
+        return m_message;
+    }
+
+    shared_ptr<const prepared_body> prepared_event_impl::get_body(packet_codec const& codec) const
+    {
+        type_index kind(typeid(codec));
+        lock_guard<mutex> guard(m_mutex);
+        for (auto it = m_bodies.begin(); it != m_bodies.end(); ++it) {
+            if (it->first == kind) {
+                return it->second;
+            }
+        }
+        shared_ptr<prepared_body> body = make_shared<prepared_body>();
+        codec.prepare(*m_message, *body);
+        m_bodies.push_back(make_pair(kind, body));
+        return body;
+    }
+
+    void packet_manager::set_codec(packet_codec::ptr const& codec)
+    {
+        m_codec = codec;
+    }
+
+    void packet_manager::set_insitu_decode(bool insitu)
+    {
+        m_insitu_decode = insitu;
+    }
+
     void packet_manager::reset()
     {
         m_partial_packet.reset();
     }
 
     void packet_manager::encode(packet& pack,encode_callback_function const& override_encode_callback) const
+    {
+        encode(*m_codec,pack,override_encode_callback ? override_encode_callback : m_encode_callback);
+    }
+
+    void packet_manager::encode(packet_codec const& codec,packet& pack,encode_callback_function const& encode_callback)
     {
         shared_ptr<string> ptr = make_shared<string>();
         vector<shared_ptr<const string> > buffers;
-        const encode_callback_function *cb_ptr = &m_encode_callback;
-        if(override_encode_callback)
+        bool binary_payload = false;
+        if(pack.get_prepared())
         {
-            cb_ptr = &override_encode_callback;
+            binary_payload = codec.encode_prepared(pack,*pack.get_prepared()->get_body(codec),*ptr,buffers);
         }
-        if(pack.accept(*ptr,buffers))
+        else if(pack.get_frame() == packet::frame_message)
         {
-            if((*cb_ptr))
-            {
-                (*cb_ptr)(false,ptr);
-            }
+            binary_payload = codec.encode(pack,*ptr,buffers);
+        }
+        else
+        {
+            pack.accept(*ptr,buffers);
+        }
+        if(encode_callback)
+        {
+            encode_callback(binary_payload,ptr);
             for(auto it = buffers.begin();it!=buffers.end();++it)
             {
-                if((*cb_ptr))
-                {
-                    (*cb_ptr)(true,*it);
-                }
+                encode_callback(true,*it);
             }
         }
-        else
+    }
+
+    static string const& payload_ref(string const& payload)
+    {
+        return payload;
+    }
+
+    static string const& payload_ref(shared_ptr<string> const& payload)
+    {
+        return *payload;
+    }
+
+    static shared_ptr<string> shared_payload(string const& payload)
+    {
+        return make_shared<string>(payload);
+    }
+
+    static shared_ptr<string> const& shared_payload(shared_ptr<string> const& payload)
+    {
+        return payload;
+    }
+
+    static bool parse_payload(packet& p, string const& payload, bool)
+    {
+        return p.parse(payload);
+    }
+
+    static bool parse_payload(packet& p, shared_ptr<string> const& payload, bool insitu)
+    {
+        return p.parse(payload, insitu);
+    }
+
+    bool packet_manager::decode_whole(shared_ptr<string> const& payload,bool insitu,packet& pack) const
+    {
+        if(packet::is_text_message(*payload))
         {
-            if((*cb_ptr))
+            if(pack.parse(payload, insitu))
             {
-                (*cb_ptr)(false,ptr);
+                //attachments follow, they are joined by put_payload.
+                return false;
             }
         }
+        else if(!m_codec->is_binary_packet(*payload) || m_codec->decode(pack, payload, insitu))
+        {
+            return false;
+        }
+        pack.get_message();
+        return true;
+    }
+
+    void packet_manager::put_packet(packet&& pack)
+    {
+        if(m_decode_callback)
+        {
+            m_decode_callback(std::move(pack));
+        }
     }
 
     void packet_manager::put_payload(string const& payload)
+    {
+        put_payload_impl(payload);
+    }
+
+    void packet_manager::put_payload(shared_ptr<string> const& payload)
+    {
+        put_payload_impl(payload);
+    }
+
+    template<typename payload_type>
+    void packet_manager::put_payload_impl(payload_type const& payload)
     {
         unique_ptr<packet> p;
         do
         {
-            if(packet::is_text_message(payload))
+            if(packet::is_text_message(payload_ref(payload)))
+            {
+                p.reset(new packet());
+                if(parse_payload(*p, payload, m_insitu_decode))
+                {
+                    m_partial_packet = std::move(p);
+                }
+                else
+                {
+                    break;
+                }
+            }
+            else if(m_codec->is_binary_packet(payload_ref(payload)))
             {
                 p.reset(new packet());
-                if(p->parse(payload))
+                if(m_codec->decode(*p, shared_payload(payload), m_insitu_decode))
                 {
                     m_partial_packet = std::move(p);
                 }
@@ -486,7 +971,7 @@ namespace sio
                     break;
                 }
             }
-            else if(packet::is_binary_message(payload))
+            else if(packet::is_binary_message(payload_ref(payload)))
             {
                 if(m_partial_packet)
                 {
@@ -500,7 +985,7 @@ namespace sio
             else
             {
                 p.reset(new packet());
-                p->parse(payload);
+                parse_payload(*p, payload, m_insitu_decode);
                 break;
             }
             return;
@@ -508,7 +993,7 @@ namespace sio
 
         if(m_decode_callback)
         {
-            m_decode_callback(*p);
+            m_decode_callback(std::move(*p));
         }
     }
 }
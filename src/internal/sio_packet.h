@@ -8,11 +8,16 @@
 #define SIO_PACKET_H
 #include <sstream>
 #include "../sio_message.h"
+#include "../sio_socket.h"
 #include <functional>
+#include <mutex>
+#include <typeindex>
 
 namespace sio
 {
     using namespace std;
+
+    class prepared_event_impl;
     
     class packet
     {
@@ -46,12 +51,30 @@ namespace sio
         int _type;
         string _nsp;
         int _pack_id;
-        message::ptr _message;
+        mutable message::ptr _message;
         unsigned _pending_buffers;
-        vector<shared_ptr<const string> > _buffers;
+        mutable vector<shared_ptr<const string> > _buffers;
+        mutable shared_ptr<string> _payload;//text frame holding the json body, until it is decoded.
+        size_t _json_pos;
+        bool _insitu;
+        bool _has_event_name;
+        string _event_name;
+        bool _compress;
+        shared_ptr<const prepared_event_impl> _prepared;
+
+        size_t parse_header(string const& payload_ptr);//return start of json body, or npos if none.
+
+        void parse_event_name();
+
+        void decode_payload() const;
     public:
         packet(string const& nsp,message::ptr const& msg,int pack_id = -1,bool isAck = false);//message type constructor.
+
+        packet(string const& nsp,message::ptr&& msg,int pack_id = -1,bool isAck = false);
         
+        //event whose arguments are already serialized, only the header is encoded for this packet.
+        packet(string const& nsp,shared_ptr<const prepared_event_impl> const& prepared,int pack_id = -1);
+
         packet(frame_type frame);
         
         packet(type type,string const& nsp= string(),message::ptr const& msg = message::ptr());//other message types constructor.
@@ -61,46 +84,166 @@ namespace sio
         frame_type get_frame() const;
         
         type get_type() const;
+
+        bool is_control() const;//acks, connects and engine.io frames, known before the packet is encoded.
         
         bool parse(string const& payload_ptr);//return true if need to parse buffer.
+
+        //keep payload_ptr as the json body instead of copying it.
+        //in situ, decoded strings keep payload_ptr alive and point into it instead of owning copies.
+        bool parse(shared_ptr<string> const& payload_ptr,bool insitu = true);
         
         bool parse_buffer(string const& buf_payload);
+
+        bool parse_buffer(shared_ptr<const string> const& buf_payload);
         
         bool accept(string& payload_ptr, vector<shared_ptr<const string> >&buffers); //return true if has binary buffers.
         
         string const& get_nsp() const;
         
-        message::ptr const& get_message() const;
+        message::ptr const& get_message() const;//the json body is decoded on first call.
+
+        message::ptr take_message();//decoded like get_message, then moved out of the packet.
+
+        bool has_event_name() const;
+
+        string const& get_event_name() const;//available for events without decoding the body.
         
         unsigned get_pack_id() const;
+
+        bool get_compress() const;//whether the transport may compress the frames of this packet.
+
+        void set_compress(bool compress);
+
+        shared_ptr<const prepared_event_impl> const& get_prepared() const;
         
+        //decode a json text into a message tree, through a SAX handler.
+        static message::ptr decode_json(string const& json);
+
         static bool is_message(string const& payload_ptr);
         static bool is_text_message(string const& payload_ptr);
         static bool is_binary_message(string const& payload_ptr);
+
+        friend class json_codec;
+        friend class msgpack_codec;
+    };
+
+    // Arguments of a prepared event as serialized by one codec, attachments included.
+    struct prepared_body
+    {
+        string data;
+        vector<shared_ptr<const string> > buffers;
+    };
+
+    // Wire encoding of socket.io packets (frame_message). Engine.IO frames are always text.
+    class packet_codec
+    {
+    public:
+        typedef shared_ptr<const packet_codec> ptr;
+
+        virtual ~packet_codec() {}
+
+        //encode pack into payload, attachments sent as separate binary frames go to buffers.
+        //return true if payload itself must be sent as a binary frame.
+        virtual bool encode(packet& pack,string& payload,vector<shared_ptr<const string> >& buffers) const = 0;
+
+        //return true if payload is a whole packet in this codec's binary format.
+        virtual bool is_binary_packet(string const& payload) const = 0;
+
+        //decode a binary packet, return true if more frames are needed to complete it.
+        virtual bool decode(packet& pack,shared_ptr<string> const& payload,bool insitu) const = 0;
+
+        //serialize the arguments of an event once, for encode_prepared.
+        virtual void prepare(message const& msg,prepared_body& body) const = 0;
+
+        //encode an event packet around a prepared body, writing only its header.
+        virtual bool encode_prepared(packet& pack,prepared_body const& body,string& payload,vector<shared_ptr<const string> >& buffers) const = 0;
+    };
+
+    // Default socket.io parser: json text frames followed by one binary frame per attachment.
+    class json_codec : public packet_codec
+    {
+    public:
+        bool encode(packet& pack,string& payload,vector<shared_ptr<const string> >& buffers) const;
+
+        bool is_binary_packet(string const& payload) const;
+
+        bool decode(packet& pack,shared_ptr<string> const& payload,bool insitu) const;
+
+        void prepare(message const& msg,prepared_body& body) const;
+
+        bool encode_prepared(packet& pack,prepared_body const& body,string& payload,vector<shared_ptr<const string> >& buffers) const;
+    };
+
+    class prepared_event_impl : public prepared_event
+    {
+    public:
+        prepared_event_impl(string const& name,message::ptr const& msg);
+
+        string const& get_name() const;
+
+        message::ptr const& get_message() const;
+
+        //serialized by the first emit through a codec of this type, then shared by every later one.
+        shared_ptr<const prepared_body> get_body(packet_codec const& codec) const;
+
+    private:
+        const string m_name;
+        const message::ptr m_message;
+        mutable mutex m_mutex;
+        mutable vector<pair<type_index,shared_ptr<const prepared_body> > > m_bodies;
     };
     
     class packet_manager
     {
     public:
         typedef function<void (bool,shared_ptr<const string> const&)> encode_callback_function;
-        typedef  function<void (packet const&)> decode_callback_function;
+        typedef  function<void (packet&&)> decode_callback_function;
         
+        //the callback may move from the decoded packet.
         void set_decode_callback(decode_callback_function const& decode_callback);
 
         void set_encode_callback(encode_callback_function const& encode_callback);
+
+        void set_codec(packet_codec::ptr const& codec);
+
+        packet_codec const& get_codec() const { return *m_codec; }
         
         void encode(packet& pack,encode_callback_function const& override_encode_callback = encode_callback_function()) const;
+
+        //encode with codec, touching no state of a manager so it may run on any thread.
+        static void encode(packet_codec const& codec,packet& pack,encode_callback_function const& encode_callback);
         
         void put_payload(string const& payload);
+
+        //takes over the payload instead of copying the json body out of it.
+        void put_payload(shared_ptr<string> const& payload);
+
+        //decode payloads given as shared_ptr in place.
+        void set_insitu_decode(bool insitu);
+
+        //decode a frame holding a whole packet, body included, into pack without touching the manager's state,
+        //so it may run on another thread. Return false for frames that must go through put_payload.
+        bool decode_whole(shared_ptr<string> const& payload,bool insitu,packet& pack) const;
+
+        //deliver a packet decoded by decode_whole, in place of its frame.
+        void put_packet(packet&& pack);
         
         void reset();
         
     private:
+        template<typename payload_type>
+        void put_payload_impl(payload_type const& payload);
+
         decode_callback_function m_decode_callback;
         
         encode_callback_function m_encode_callback;
         
         std::unique_ptr<packet> m_partial_packet;
+
+        bool m_insitu_decode = false;
+
+        packet_codec::ptr m_codec = std::make_shared<json_codec>();
     };
 }
 #endif
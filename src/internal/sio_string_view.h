@@ -0,0 +1,64 @@
+//
+//  sio_string_view.h
+//
+
+#ifndef SIO_STRING_VIEW_H
+#define SIO_STRING_VIEW_H
+#include "../sio_message.h"
+#include <mutex>
+
+namespace sio
+{
+    // String decoded in situ: refers into the frame it came from, which it keeps alive,
+    // and only copies its characters out on the first get_string.
+    class string_view_message : public string_message
+    {
+    public:
+        static message::ptr create(std::shared_ptr<const std::string> const& frame,const char* data,size_t length)
+        {
+            //a string short enough to be stored inline costs no allocation, a copy is smaller than the view.
+            if(length <= short_length())
+            {
+                return string_message::create(std::string(data,length));
+            }
+            return ptr(new string_view_message(frame,data,length));
+        }
+
+        std::string const& get_string() const
+        {
+            std::call_once(m_materialized,[this]()
+            {
+                _v.assign(m_data,m_length);
+            });
+            return _v;
+        }
+
+        const char* data() const
+        {
+            return m_data;
+        }
+
+        size_t length() const
+        {
+            return m_length;
+        }
+
+    private:
+        string_view_message(std::shared_ptr<const std::string> const& frame,const char* data,size_t length)
+            :m_frame(frame),m_data(data),m_length(length)
+        {
+        }
+
+        static size_t short_length()
+        {
+            static const size_t length = std::string().capacity();
+            return length;
+        }
+
+        std::shared_ptr<const std::string> m_frame;
+        const char* m_data;
+        size_t m_length;
+        mutable std::once_flag m_materialized;
+    };
+}
+#endif
@@ -0,0 +1,106 @@
+//
+//  sio_write_batch.h
+//
+
+#ifndef SIO_WRITE_BATCH_H
+#define SIO_WRITE_BATCH_H
+#include <asio/steady_timer.hpp>
+#include <asio/io_service.hpp>
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace sio
+{
+    // Masked frames batched into a single socket write, handed to flush once the batch reaches max_bytes,
+    // once the delay budget started by its first frame runs out, or on the last uncork. One timer serves every batch.
+    // Not thread safe, owned by the network thread.
+    class write_batch
+    {
+    public:
+        write_batch(asio::io_service& io, size_t max_bytes, std::function<void()> const& flush):
+            m_timer(io),
+            m_max_bytes(max_bytes),
+            m_flush(flush),
+            m_corks(0),
+            m_armed(false)
+        {
+        }
+
+        // Frames are appended here, each followed by a call to appended.
+        std::string& frames() { return m_frames; }
+
+        bool empty() const { return m_frames.empty(); }
+
+        bool corked() const { return m_corks > 0; }
+
+        void appended(unsigned delay_micros)
+        {
+            if (m_frames.size() >= m_max_bytes) {
+                m_flush();
+            }
+            else if (m_corks == 0 && !m_armed) {
+                m_armed = true;
+                asio::error_code ec;
+                m_timer.expires_from_now(std::chrono::microseconds(delay_micros), ec);
+                m_timer.async_wait(std::bind(&write_batch::timeout, this, std::placeholders::_1));
+            }
+        }
+
+        // Calls nest, the batch is flushed by the last uncork.
+        void cork() { m_corks++; }
+
+        void uncork()
+        {
+            if (m_corks > 0 && --m_corks == 0) {
+                m_flush();
+            }
+        }
+
+        // Swaps the batched frames into out, which keeps the buffer's capacity for the next batch.
+        void take(std::string& out)
+        {
+            stop();
+            out.swap(m_frames);
+            m_frames.clear();
+        }
+
+        // Drops the frames and the corks along with the connection they were meant for.
+        void clear()
+        {
+            stop();
+            m_frames.clear();
+            m_corks = 0;
+        }
+
+    private:
+        void timeout(asio::error_code const& ec)
+        {
+            if (ec || !m_armed) {
+                return;
+            }
+            m_armed = false;
+            m_flush();
+        }
+
+        void stop()
+        {
+            if (m_armed) {
+                m_armed = false;
+                asio::error_code ec;
+                m_timer.cancel(ec);
+            }
+        }
+
+        asio::steady_timer m_timer;
+        std::string m_frames;
+        size_t m_max_bytes;
+        std::function<void()> m_flush;
+        unsigned m_corks;
+        bool m_armed;
+
+        write_batch(write_batch const&);
+        void operator=(write_batch const&);
+    };
+}
+#endif
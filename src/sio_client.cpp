@@ -23,6 +23,35 @@ namespace sio
             return shared_ptr<client>(new client_impl<client_type_no_tls>(uri));
     }
 
+    client::ptr client::create(const std::string& uri, client_runtime::ptr const& runtime)
+    {
+        std::shared_ptr<runtime_impl> shared = std::static_pointer_cast<runtime_impl>(runtime);
+#if SIO_TLS
+        if (client_base::is_tls(uri))
+            return shared_ptr<client>(new client_impl<client_type_tls>(uri, shared), &client_impl<client_type_tls>::release);
+        else
+#endif
+            return shared_ptr<client>(new client_impl<client_type_no_tls>(uri, shared), &client_impl<client_type_no_tls>::release);
+    }
+
+    client_runtime::ptr client_runtime::create(unsigned threads)
+    {
+        if (threads == 0)
+        {
+            threads = std::thread::hardware_concurrency();
+        }
+        return std::make_shared<runtime_impl>(threads > 0 ? threads : 1);
+    }
+
+    client_runtime::~client_runtime()
+    {
+    }
+
+    client_runtime::client_runtime()
+    {
+
+    }
+
     client::~client()
     {
     }
@@ -14,6 +14,24 @@
 namespace sio
 {
 
+    // Network threads shared by many clients, each client runs all its work on the one it is assigned to.
+    class SIO_API client_runtime {
+    public:
+        typedef std::shared_ptr<client_runtime> ptr;
+        // 0 threads starts one per hardware thread.
+        static ptr create(unsigned threads = 0);
+        virtual ~client_runtime();
+
+        virtual unsigned get_threads() const = 0;
+
+    protected:
+        client_runtime();
+    private:
+        //disable copy constructor and assign operator.
+        client_runtime(client_runtime const&) {}
+        void operator=(client_runtime const&) {}
+    };
+
     class SIO_API client {
     public:
         enum close_reason
@@ -32,6 +50,8 @@ namespace sio
 
         typedef std::shared_ptr<client> ptr;
         static ptr create(const std::string& uri);
+        // Client without a network thread of its own, it runs on one of the runtime's threads.
+        static ptr create(const std::string& uri, client_runtime::ptr const& runtime);
         virtual ~client();
 
         //set listeners and event bindings.
@@ -49,6 +69,12 @@ namespace sio
 
         virtual void set_socket_close_listener(socket_listener const& l) = 0;
 
+        // Called on the network thread when the buffered amount rises to the high watermark,
+        // and when it falls back to the low watermark.
+        virtual void set_high_watermark_listener(con_listener const& l) = 0;
+
+        virtual void set_low_watermark_listener(con_listener const& l) = 0;
+
         virtual void clear_con_listeners() = 0;
 
         virtual void clear_socket_listeners() = 0;
@@ -63,6 +89,83 @@ namespace sio
 
         virtual void set_reconnect_delay_max(unsigned millis) = 0;
 
+        // Decode inbound text frames in place: strings of received messages share the frame buffer instead of copying it.
+        virtual void set_zero_copy_decode(bool enabled) = 0;
+
+        enum codec_type
+        {
+            codec_json,
+            codec_msgpack
+        };
+        // Wire encoding of socket.io packets, must match the server's parser. Applied on the next connect.
+        virtual void set_codec(codec_type codec) = 0;
+
+        // permessage-deflate, effective when built with SIO_DEFLATE and accepted by the server. Applied on the next connect.
+        virtual void set_compression(bool enabled) = 0;
+
+        // Window bits (8-15) the server is asked to compress with.
+        virtual void set_compression_window_bits(unsigned bits) = 0;
+
+        // Disabling context takeover asks the server to compress every message on its own.
+        virtual void set_compression_context_takeover(bool enabled) = 0;
+
+        // Frames smaller than this are sent uncompressed.
+        virtual void set_compression_threshold(size_t bytes) = 0;
+
+        // Bytes handed to the websocket transport and not yet written to the network.
+        virtual size_t get_buffered_amount() const = 0;
+
+        // Watermarks on the buffered amount in bytes, a high watermark of 0 disables the listeners.
+        virtual void set_buffered_amount_watermarks(size_t high, size_t low) = 0;
+
+        // Events are handed to the transport only while its buffered amount is below this window (64KB by default),
+        // so pongs, acks and connects are queued behind no more than that, or one larger event. 0 sends everything in emit order.
+        virtual void set_bulk_window(size_t bytes) = 0;
+
+        // Frames sent within delay_micros of each other are batched into one socket write, 0 (default) disables it.
+        virtual void set_write_coalescing(unsigned delay_micros) = 0;
+
+        // Between cork() and uncork(), frames are batched until uncork(), pongs and acks excepted. Calls nest.
+        virtual void cork() = 0;
+
+        virtual void uncork() = 0;
+
+        // Frames of at least threshold_bytes are decoded on this many worker threads, still delivered in arrival order.
+        // 0 threads (default) decodes everything on the network thread. Applied on the first connect.
+        virtual void set_parallel_decode(unsigned threads, size_t threshold_bytes) = 0;
+
+        // socket::emit_async encodes on this many worker threads, 0 (default) encodes on the network thread.
+        // Applied on the first connect.
+        virtual void set_parallel_encode(unsigned threads) = 0;
+
+        typedef std::function<void(std::function<void()> const& task)> executor;
+
+        enum dispatch_order
+        {
+            dispatch_by_namespace,
+            dispatch_by_event
+        };
+
+        // Run event listeners and ack callbacks on this many worker threads instead of the network thread, 0 (default) runs them inline.
+        // Applied on the first connect.
+        virtual void set_dispatch_threads(unsigned threads) = 0;
+
+        // Run event listeners through a user-supplied executor, takes precedence over set_dispatch_threads.
+        virtual void set_dispatch_executor(executor const& e) = 0;
+
+        // Listeners run in arrival order per namespace (default), or per namespace and event name.
+        virtual void set_dispatch_order(dispatch_order order) = 0;
+
+        // Don't start a network thread on connect(), the application drives the client instead by calling poll() or run_one()
+        // from one thread of its own, which then runs all listeners. Applied on the next connect.
+        virtual void set_manual_poll(bool enabled) = 0;
+
+        // Runs the pending network work without blocking, returns the number of handlers run.
+        virtual size_t poll() = 0;
+
+        // Blocks until one handler has run, returns 0 once the client is closed and has nothing left to do.
+        virtual size_t run_one() = 0;
+
         enum LogLevel
         {
             log_default,
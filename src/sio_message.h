@@ -211,7 +211,6 @@ namespace sio
 
     class SIO_API string_message : public message
     {
-        std::string _v;
         string_message(std::string const& v)
             :message(flag_string),_v(v)
         {
@@ -221,6 +220,14 @@ namespace sio
             :message(flag_string),_v(move(v))
         {
         }
+    protected:
+        //strings keeping their characters elsewhere override the accessors, and fill _v on the first get_string.
+        string_message()
+            :message(flag_string)
+        {
+        }
+
+        mutable std::string _v;
     public:
         static message::ptr create(std::string const& v)
         {
@@ -236,6 +243,17 @@ namespace sio
         {
             return _v;
         }
+
+        // Characters of the string, not null terminated. Never copies them, unlike get_string on a string decoded in place.
+        virtual const char* data() const
+        {
+            return _v.data();
+        }
+
+        virtual size_t length() const
+        {
+            return _v.length();
+        }
     };
 
     class SIO_API binary_message : public message
@@ -276,6 +294,12 @@ namespace sio
                 _v.push_back(message);
         }
 
+        void push(message::ptr&& message)
+        {
+            if(message)
+                _v.push_back(std::move(message));
+        }
+
         void push(const std::string& text)
         {
             _v.push_back(string_message::create(text));
@@ -442,12 +466,18 @@ namespace sio
 
         }
 
-        list & operator= (const message::list && rhs)
+        list & operator= (message::list && rhs)
         {
             m_vector = std::move(rhs.m_vector);
             return *this;
         }
 
+        list & operator= (message::list const& rhs)
+        {
+            m_vector = rhs.m_vector;
+            return *this;
+        }
+
         template <typename T>
         list(T&& content,
             typename std::enable_if<std::is_same<std::vector<message::ptr>,typename std::remove_reference<T>::type>::value>::type* = 0):
@@ -468,6 +498,12 @@ namespace sio
 
         }
 
+        list(message::ptr&& message)
+        {
+            if(message)
+                m_vector.push_back(std::move(message));
+        }
+
         list(const std::string& text)
         {
             m_vector.push_back(string_message::create(text));
@@ -496,6 +532,12 @@ namespace sio
                 m_vector.push_back(message);
         }
 
+        void push(message::ptr&& message)
+        {
+            if(message)
+                m_vector.push_back(std::move(message));
+        }
+
         void push(const std::string& text)
         {
             m_vector.push_back(string_message::create(text));
@@ -560,21 +602,38 @@ namespace sio
             return m_vector[i];
         }
 
-        message::ptr to_array_message(std::string const& event_name) const
+        message::ptr to_array_message(std::string const& event_name) const&
         {
             message::ptr arr = array_message::create();
+            arr->get_vector().reserve(m_vector.size() + 1);
             arr->get_vector().push_back(string_message::create(event_name));
             arr->get_vector().insert(arr->get_vector().end(),m_vector.begin(),m_vector.end());
             return arr;
         }
 
-        message::ptr to_array_message() const
+        //moves the messages into the array instead of sharing them.
+        message::ptr to_array_message(std::string const& event_name) &&
+        {
+            message::ptr arr = array_message::create();
+            m_vector.insert(m_vector.begin(), string_message::create(event_name));
+            arr->get_vector().swap(m_vector);
+            return arr;
+        }
+
+        message::ptr to_array_message() const&
         {
             message::ptr arr = array_message::create();
             arr->get_vector().insert(arr->get_vector().end(),m_vector.begin(),m_vector.end());
             return arr;
         }
 
+        message::ptr to_array_message() &&
+        {
+            message::ptr arr = array_message::create();
+            arr->get_vector().swap(m_vector);
+            return arr;
+        }
+
     private:
         std::vector<message::ptr> m_vector;
     };
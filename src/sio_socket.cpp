@@ -1,9 +1,15 @@
 #include "sio_socket.h"
 #include "internal/sio_packet.h"
 #include "internal/sio_client_impl.h"
+#include "internal/sio_mpsc_queue.h"
 #include <asio/steady_timer.hpp>
 #include <asio/error_code.hpp>
 #include <queue>
+#include <climits>
+#include <vector>
+#include <condition_variable>
+#include <unordered_map>
+#include <atomic>
 #include <chrono>
 #include <cstdarg>
 #include <functional>
@@ -21,17 +27,53 @@ namespace sio
             func(event.get_name(),event.get_message(),event.need_ack(),event.get_ack_message_impl());
         }
         
-        static inline socket::event_listener do_adapt(socket::event_listener_aux const& func)
+        static inline event create_event(std::string const& nsp,std::string const& name,message::list&& message,bool need_ack)
         {
-            return std::bind(&event_adapter::adapt_func, func,std::placeholders::_1);
+            return event(nsp,name,std::move(message),need_ack);
         }
-        
-        static inline event create_event(std::string const& nsp,std::string const& name,message::list&& message,bool need_ack)
+
+        static inline event create_event(std::string const& nsp,std::string const& name,std::shared_ptr<packet>&& body,bool need_ack)
+        {
+            return event(nsp,name,std::move(body),need_ack);
+        }
+
+        static inline std::shared_ptr<event> create_shared_event(std::string const& nsp,std::string const& name,message::list&& message,bool need_ack)
+        {
+            return std::shared_ptr<event>(new event(nsp,name,std::move(message),need_ack));
+        }
+
+        static inline std::shared_ptr<event> create_shared_event(std::string const& nsp,std::string const& name,std::shared_ptr<packet>&& body,bool need_ack)
+        {
+            return std::shared_ptr<event>(new event(nsp,name,std::move(body),need_ack));
+        }
+
+        static inline message::list& get_ack_message(event& ev)
+        {
+            return ev.get_ack_message_impl();
+        }
+
+        static inline bool body_decoded(event const& ev)
         {
-            return event(nsp,name,message,need_ack);
+            return !ev.m_body;
         }
     };
     
+    // Elements of an event or ack array from first on, moved out of it when nothing else refers to the array.
+    static message::list take_arguments(message::ptr&& array, size_t first)
+    {
+        std::vector<message::ptr>& items = array->get_vector();
+        if(first > items.size())
+        {
+            return message::list();
+        }
+        if(array.use_count() == 1)
+        {
+            items.erase(items.begin(), items.begin() + first);
+            return message::list(std::move(items));
+        }
+        return message::list(std::vector<message::ptr>(items.begin() + first, items.end()));
+    }
+
     const std::string& event::get_nsp() const
     {
         return m_nsp;
@@ -44,6 +86,7 @@ namespace sio
     
     const message::ptr& event::get_message() const
     {
+        decode_body();
         if(m_messages.size()>0)
             return m_messages[0];
         else
@@ -55,8 +98,24 @@ namespace sio
 
     const message::list& event::get_messages() const
     {
+        decode_body();
         return m_messages;
     }
+
+    void event::decode_body() const
+    {
+        if(!m_body)
+        {
+            return;
+        }
+        std::shared_ptr<packet> body = std::move(m_body);
+        message::ptr ptr = body.use_count() == 1 ? body->take_message() : body->get_message();
+        if(ptr && ptr->get_flag() == message::flag_array)
+        {
+            //first element is the event name.
+            m_messages = take_arguments(std::move(ptr), 1);
+        }
+    }
     
     bool event::need_ack() const
     {
@@ -64,6 +123,12 @@ namespace sio
     }
     
     void event::put_ack_message(message::list const& ack_message)
+    {
+        if(m_need_ack)
+            m_ack_message = ack_message;
+    }
+
+    void event::put_ack_message(message::list&& ack_message)
     {
         if(m_need_ack)
             m_ack_message = std::move(ack_message);
@@ -78,6 +143,15 @@ namespace sio
     {
     }
 
+    inline
+    event::event(std::string const& nsp,std::string const& name,std::shared_ptr<packet>&& body,bool need_ack):
+        m_nsp(nsp),
+        m_name(name),
+        m_body(std::move(body)),
+        m_need_ack(need_ack)
+    {
+    }
+
     inline
     event::event(std::string const& nsp,std::string const& name,message::list const& messages,bool need_ack):
         m_nsp(nsp),
@@ -98,7 +172,167 @@ namespace sio
         return m_ack_message;
     }
     
-    class socket_impl : public socket
+    // Latest unsent packet of a conflated key, replaced in place by newer emits.
+    // Registered under its key while queued, both guarded by the socket's m_conflation_mutex.
+    struct conflation_slot
+    {
+        std::string key;
+        // Null once the offline queue holds the packet encoded, until a newer emit.
+        std::shared_ptr<packet> pending;
+    };
+
+    // Packet of emit_async, encoded off the emitting thread. Its outbound_packet holds the head of the queue until it is done.
+    struct encode_job
+    {
+        encode_job():offloaded(false),done(false) {}
+
+        packet pack;
+        std::vector<outbound_frame> frames;
+        bool offloaded;//encoded on the client's encode pool, otherwise by the drain.
+        std::atomic<bool> done;
+        socket::emit_listener callback;
+        packet_codec::ptr codec;//of the connection at emit time, workers never touch the client's.
+    };
+
+    // A packet on its way to the transport, with the conditions it may be dropped on.
+    // For conflated emits it only marks the slot, whose latest packet is taken when sent.
+    // Held in the offline queue, the packet is replaced by its encoded frames.
+    struct outbound_packet
+    {
+        outbound_packet():
+            pack_id(-1),
+            is_volatile(false),
+            deadline(std::chrono::steady_clock::time_point::max()),
+            bytes(0)
+        {
+        }
+
+        outbound_packet(packet&& p,bool v,std::chrono::steady_clock::time_point d):
+            pack(std::move(p)),
+            pack_id((int)pack.get_pack_id()),
+            is_volatile(v),
+            deadline(d),
+            bytes(0)
+        {
+        }
+
+        explicit outbound_packet(std::shared_ptr<conflation_slot> const& s):
+            pack_id(-1),
+            is_volatile(false),
+            deadline(std::chrono::steady_clock::time_point::max()),
+            slot(s),
+            bytes(0)
+        {
+        }
+
+        packet pack;
+        int pack_id;
+        bool is_volatile;
+        std::chrono::steady_clock::time_point deadline;
+        std::shared_ptr<conflation_slot> slot;
+        std::vector<outbound_frame> frames;
+        size_t bytes;
+        std::shared_ptr<encode_job> job;
+    };
+
+    // Decode counts of one event name, shared by every binding of that name so they survive on() and off().
+    struct decode_counter
+    {
+        decode_counter():decoded(0),skipped(0) {}
+
+        std::atomic<uint64_t> decoded;
+        std::atomic<uint64_t> skipped;
+
+        void count(bool body_decoded)
+        {
+            (body_decoded ? decoded : skipped).fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    // Immutable snapshot of the event bindings, rebuilt as a whole by on() and off() and read without locking.
+    // Names are hashed once when bound, lookups compare the hash before the name.
+    class listener_table
+    {
+    public:
+        struct entry
+        {
+            size_t hash;
+            std::string name;
+            socket::event_listener func;
+            socket::event_listener_aux aux;
+            std::shared_ptr<decode_counter> stats;
+
+            void invoke(event& ev) const
+            {
+                if(aux)
+                    event_adapter::adapt_func(aux, ev);
+                else
+                    func(ev);
+            }
+        };
+
+        explicit listener_table(std::vector<entry>&& entries):
+            m_entries(std::move(entries))
+        {
+            size_t size = 8;
+            while(size < m_entries.size() * 2)
+            {
+                size <<= 1;
+            }
+            m_slots.assign(size, -1);
+            for(size_t i = 0; i < m_entries.size(); ++i)
+            {
+                size_t slot = m_entries[i].hash & (size - 1);
+                while(m_slots[slot] >= 0)
+                {
+                    slot = (slot + 1) & (size - 1);
+                }
+                m_slots[slot] = (int)i;
+            }
+        }
+
+        entry const* find(std::string const& name) const
+        {
+            size_t hash = std::hash<std::string>()(name);
+            size_t mask = m_slots.size() - 1;
+            for(size_t slot = hash & mask; m_slots[slot] >= 0; slot = (slot + 1) & mask)
+            {
+                entry const& e = m_entries[m_slots[slot]];
+                if(e.hash == hash && e.name == name)
+                {
+                    return &e;
+                }
+            }
+            return NULL;
+        }
+
+        std::vector<entry> const& entries() const
+        {
+            return m_entries;
+        }
+
+    private:
+        std::vector<entry> m_entries;
+        std::vector<int> m_slots;
+    };
+
+    // Set while a listener or an ack callback runs off the network thread, its emits never wait for room in the offline queue.
+    static thread_local bool t_running_listener = false;
+
+    struct listener_scope
+    {
+        listener_scope() { t_running_listener = true; }
+        ~listener_scope() { t_running_listener = false; }
+    };
+
+    // Callback waiting for the ack of an emitted event, with an optional deadline. Plain acks are wrapped into one.
+    struct pending_ack
+    {
+        socket::ack_listener listener;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    class socket_impl : public socket, public std::enable_shared_from_this<socket_impl>
     {
     public:
         
@@ -127,9 +361,41 @@ namespace sio
         
         void close();
         
-        void emit(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack);
+        void emit(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack, bool compress);
+
+        void emit(std::string const& name, message::list&& msglist, std::function<void (message::list const&)> const& ack, bool compress);
+
+        void emit_prepared(prepared_event::ptr const& event, std::function<void (message::list const&)> const& ack, bool compress);
+
+        void emit_with_ack(std::string const& name, message::list const& msglist, ack_listener const& ack, unsigned timeout_millis);
+
+        void emit_async(std::string const& name, message::list&& msglist, std::function<void (message::list const&)> const& ack, emit_listener const& done);
+
+        void emit_volatile(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack);
+
+        void emit_ttl(std::string const& name, message::list const& msglist, unsigned ttl_millis, std::function<void (message::list const&)> const& ack);
+
+        void emit_conflated(std::string const& name, std::string const& key, message::list const& msglist);
+
+        void set_volatile_threshold(size_t bytes) { m_volatile_threshold = bytes; }
+
+        void set_offline_limits(size_t max_bytes, size_t max_packets, overflow_policy policy);
+
+        size_t get_offline_bytes() const { return m_offline_bytes.load(std::memory_order_relaxed); }
+
+        drop_stats get_drop_stats() const;
         
         std::string const& get_namespace() const {return m_nsp;}
+
+        std::map<std::string, decode_stats> get_decode_stats() const;
+
+        size_t get_buffered_packets() const { return m_buffered_packets.load(std::memory_order_relaxed); }
+
+        void set_buffered_packets_watermarks(size_t high, size_t low) { m_high_watermark = high; m_low_watermark = low < high ? low : high; }
+
+        void on_high_watermark(watermark_listener const& l) { m_high_watermark_listener = l; }
+
+        void on_low_watermark(watermark_listener const& l) { m_low_watermark_listener = l; }
         
     protected:
         void on_connected();
@@ -138,7 +404,7 @@ namespace sio
         
         void on_open();
         
-        void on_message_packet(packet const& packet);
+        void on_message_packet(packet&& packet);
         
         void on_disconnect();
         
@@ -146,70 +412,241 @@ namespace sio
         
         // Message Parsing callbacks.
         void on_socketio_event(const std::string& nsp, int msgId,const std::string& name, message::list&& message);
+        void on_socketio_event(packet&& p);
         void on_socketio_ack(int msgId, message::list const& message);
         void on_socketio_error(message::ptr const& err_message);
         
-        event_listener get_bind_listener_locked(string const& event);
+        void dispatch_event(std::shared_ptr<const listener_table> const& table, listener_table::entry const* listener, std::shared_ptr<event> const& ev, int msgId, bool lazy);
+
+        void run_listener(std::shared_ptr<const listener_table> const& table, listener_table::entry const* listener,
+                          std::shared_ptr<event> const& ev, int msgId, bool lazy);
+
+        void bind_listener(std::string const& event_name, event_listener const& func, event_listener_aux const& aux);
+
+        void publish_listeners(std::vector<listener_table::entry>&& entries);
+
+        void count_decode(listener_table::entry const* listener, bool decoded);
+
+        std::shared_ptr<decode_counter> const& get_decode_counter(string const& event);
         
-        void ack(int msgId,string const& name,message::list const& ack_message);
+        void ack(int msgId,string const& name,message::list&& ack_message);
         
         void timeout_connection(const asio::error_code &ec);
         
         void send_connect();
         
-        void send_packet(packet& p);
+        int add_ack(std::function<void (message::list const&)> const& ack);
+
+        int add_ack(pending_ack&& entry);
+
+        void erase_ack(int msgId);
+
+        void fail_acks(client_base* client);
+
+        // Runs an ack callback where the namespace's listeners run, after the events received before it.
+        void deliver_ack(client_base* client, std::function<void()> const& callback);
+
+        void run_ack(std::function<void()> const& callback);
+
+        void arm_ack_timer();
+
+        void timeout_acks(const asio::error_code &ec);
+
+        void emit_packet(message::ptr&& msg, std::function<void (message::list const&)> const& ack,
+                         bool compress, bool is_volatile, std::chrono::steady_clock::time_point deadline);
+
+        void send_packet(packet& p, bool is_volatile = false, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+        bool drop_stale(outbound_packet const& p, std::chrono::steady_clock::time_point now);
+
+        void expire_bulk(int pack_id);
+
+        void send_outbound(outbound_packet& p);
+
+        void discard_offline();
+
+        void discard_outbound();
+
+        std::shared_ptr<packet> take_conflated(conflation_slot& slot);
+
+        void push_offline(outbound_packet&& p);
+
+        void drop_outbound(outbound_packet& p);
+
+        bool offline_full() const;
+
+        void update_offline_blocking();
+
+        void schedule_drain();
+
+        void drain_outbound();
+
+        void push_outbound(outbound_packet&& p);
+
+        bool take_outbound(outbound_packet& p);
+
+        void adopt_frames(outbound_packet& p);
+
+        void route_outbound(outbound_packet& p, std::chrono::steady_clock::time_point now);
+
+        void encode_async(std::shared_ptr<encode_job> const& job);
+
+        void complete(outbound_packet const& p, bool sent);
+
+        void flush_offline();
+
+        void check_watermarks();
         
+        // Null once closed, cleared on the network thread while emitting threads and encode workers read it.
+        client_base* get_client() const { return m_client.load(std::memory_order_acquire); }
+
         static event_listener s_null_event_listener;
         
-        static unsigned int s_global_event_id;
-        
-        sio::client_base *m_client;
+        std::atomic<sio::client_base*> m_client;
         
         bool m_connected;
         std::string m_nsp;
         
-        std::map<unsigned int, std::function<void (message::list const&)> > m_acks;
+        // Pending acks by id, under their own mutex so emits and replies do not contend with event dispatch.
+        std::unordered_map<int, pending_ack> m_acks;
+
+        typedef std::pair<std::chrono::steady_clock::time_point, int> ack_deadline;
+
+        // Deadlines of pending acks, earliest first. Entries of acks answered in time are skipped when they come up.
+        std::priority_queue<ack_deadline, std::vector<ack_deadline>, std::greater<ack_deadline> > m_ack_deadlines;
+
+        std::mutex m_ack_mutex;
+
+        std::atomic<unsigned> m_next_ack_id;
+
+        std::unique_ptr<asio::steady_timer> m_ack_timer;
         
-        std::map<std::string, event_listener> m_event_binding;
+        // Current bindings, replaced with std::atomic_store under m_event_mutex and read with std::atomic_load.
+        // A reader keeps the snapshot it loaded alive, so a replaced table goes away with its last reader.
+        std::shared_ptr<const listener_table> m_listeners;
+
+        // Counters of every event name bound, looked up by on() and when stats are read.
+        std::map<std::string, std::shared_ptr<decode_counter> > m_decode_counters;
+
+        // Events received without a listener, whatever their name, so they are counted without locking.
+        decode_counter m_unbound;
+
+        mutable std::mutex m_stats_mutex;
         
         error_listener m_error_listener;
         
         std::unique_ptr<asio::steady_timer> m_connection_timer;
         
-        std::queue<packet> m_packet_queue;
+        // Packets emitted from any thread, drained in batches on the network thread.
+        mpsc_queue<outbound_packet> m_outbound;
+
+        std::atomic<bool> m_drain_scheduled;
+
+        // Head of the outbound queue while its emit_async packet is being encoded, network thread only.
+        std::unique_ptr<outbound_packet> m_encoding_head;
+
+        // Packets held until the namespace is connected, network thread only.
+        std::queue<outbound_packet> m_packet_queue;
+
+        std::atomic<size_t> m_offline_bytes;
+
+        // Set from any thread by set_offline_limits, read by emitting threads and the network thread.
+        std::atomic<size_t> m_offline_max_bytes;
+
+        std::atomic<size_t> m_offline_max_packets;
+
+        std::atomic<overflow_policy> m_overflow_policy;
+
+        std::atomic<uint64_t> m_offline_dropped;
+
+        // Producers blocked by overflow_block wait here for the offline queue to shrink.
+        std::mutex m_offline_mutex;
+
+        std::condition_variable m_offline_cond;
+
+        // The offline queue is full under overflow_block, set by the network thread, guarded by m_offline_mutex.
+        bool m_offline_blocking;
+
+        std::atomic<size_t> m_buffered_packets;
+
+        size_t m_high_watermark;
+
+        size_t m_low_watermark;
+
+        bool m_above_high_watermark;
+
+        watermark_listener m_high_watermark_listener;
+
+        watermark_listener m_low_watermark_listener;
+
+        size_t m_volatile_threshold;
+
+        std::atomic<uint64_t> m_volatile_dropped;
+
+        std::atomic<uint64_t> m_expired;
+
+        std::atomic<uint64_t> m_conflated;
+
+        std::unordered_map<std::string, std::shared_ptr<conflation_slot> > m_conflation_slots;
+
+        std::mutex m_conflation_mutex;
         
         std::mutex m_event_mutex;
-
-		std::mutex m_packet_mutex;
         
         friend class socket;
     };
     
     void socket_impl::on(std::string const& event_name, event_listener_aux const& func)
     {
-        this->on(event_name,event_adapter::do_adapt(func));
+        bind_listener(event_name, event_listener(), func);
     }
     
     void socket_impl::on(std::string const& event_name,event_listener const& func)
     {
-        std::lock_guard<std::mutex> guard(m_event_mutex);
-        m_event_binding[event_name] = func;
+        bind_listener(event_name, func, event_listener_aux());
     }
     
     void socket_impl::off(std::string const& event_name)
     {
         std::lock_guard<std::mutex> guard(m_event_mutex);
-        auto it = m_event_binding.find(event_name);
-        if(it!=m_event_binding.end())
+        std::vector<listener_table::entry> entries;
+        entries.reserve(m_listeners->entries().size());
+        for(auto it = m_listeners->entries().begin(); it != m_listeners->entries().end(); ++it)
         {
-            m_event_binding.erase(it);
+            if(it->name != event_name)
+            {
+                entries.push_back(*it);
+            }
         }
+        publish_listeners(std::move(entries));
     }
     
     void socket_impl::off_all()
     {
         std::lock_guard<std::mutex> guard(m_event_mutex);
-        m_event_binding.clear();
+        publish_listeners(std::vector<listener_table::entry>());
+    }
+
+    void socket_impl::bind_listener(std::string const& event_name, event_listener const& func, event_listener_aux const& aux)
+    {
+        listener_table::entry binding = {std::hash<std::string>()(event_name), event_name, func, aux, get_decode_counter(event_name)};
+        std::lock_guard<std::mutex> guard(m_event_mutex);
+        std::vector<listener_table::entry> entries;
+        entries.reserve(m_listeners->entries().size() + 1);
+        for(auto it = m_listeners->entries().begin(); it != m_listeners->entries().end(); ++it)
+        {
+            if(it->name != event_name)
+            {
+                entries.push_back(*it);
+            }
+        }
+        entries.push_back(std::move(binding));
+        publish_listeners(std::move(entries));
+    }
+
+    void socket_impl::publish_listeners(std::vector<listener_table::entry>&& entries)
+    {
+        std::atomic_store(&m_listeners, std::shared_ptr<const listener_table>(std::make_shared<listener_table>(std::move(entries))));
     }
     
     void socket_impl::on_error(error_listener const& l)
@@ -225,13 +662,25 @@ namespace sio
     socket_impl::socket_impl(client_base* client,std::string const& nsp):
         m_client(client),
         m_connected(false),
-        m_nsp(nsp)
+        m_nsp(nsp),
+        m_next_ack_id(0),
+        m_drain_scheduled(false),
+        m_offline_bytes(0),
+        m_offline_max_bytes(0),
+        m_offline_max_packets(0),
+        m_overflow_policy(overflow_drop_oldest),
+        m_offline_dropped(0),
+        m_offline_blocking(false),
+        m_buffered_packets(0),
+        m_high_watermark(0),
+        m_low_watermark(0),
+        m_above_high_watermark(false),
+        m_volatile_threshold(0),
+        m_volatile_dropped(0),
+        m_expired(0),
+        m_conflated(0)
     {
-        NULL_GUARD(client);
-        if(m_client->opened())
-        {
-            send_connect();
-        }
+        m_listeners = std::make_shared<listener_table>(std::vector<listener_table::entry>());
     }
     
     socket_impl::~socket_impl()
@@ -239,88 +688,310 @@ namespace sio
         
     }
     
-    unsigned int socket_impl::s_global_event_id = 1;
-    
-    void socket_impl::emit(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack)
+    void socket_impl::emit(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack, bool compress)
+    {
+        emit_packet(msglist.to_array_message(name), ack, compress, false, std::chrono::steady_clock::time_point::max());
+    }
+
+    void socket_impl::emit(std::string const& name, message::list&& msglist, std::function<void (message::list const&)> const& ack, bool compress)
+    {
+        emit_packet(std::move(msglist).to_array_message(name), ack, compress, false, std::chrono::steady_clock::time_point::max());
+    }
+
+    void socket_impl::emit_prepared(prepared_event::ptr const& event, std::function<void (message::list const&)> const& ack, bool compress)
     {
         NULL_GUARD(m_client);
-        message::ptr msg_ptr = msglist.to_array_message(name);
-        int pack_id;
-        if(ack)
-        {
-            pack_id = s_global_event_id++;
-            std::lock_guard<std::mutex> guard(m_event_mutex);
-            m_acks[pack_id] = ack;
-        }
-        else
-        {
-            pack_id = -1;
-        }
-        packet p(m_nsp, msg_ptr,pack_id);
+        NULL_GUARD(event);
+        packet p(m_nsp, std::static_pointer_cast<const prepared_event_impl>(event), add_ack(ack));
+        p.set_compress(compress);
         send_packet(p);
     }
-    
-    void socket_impl::send_connect()
+
+    void socket_impl::emit_volatile(std::string const& name, message::list const& msglist, std::function<void (message::list const&)> const& ack)
+    {
+        emit_packet(msglist.to_array_message(name), ack, true, true, std::chrono::steady_clock::time_point::max());
+    }
+
+    void socket_impl::emit_ttl(std::string const& name, message::list const& msglist, unsigned ttl_millis, std::function<void (message::list const&)> const& ack)
+    {
+        emit_packet(msglist.to_array_message(name), ack, true, false, std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_millis));
+    }
+
+    void socket_impl::emit_packet(message::ptr&& msg, std::function<void (message::list const&)> const& ack,
+                                  bool compress, bool is_volatile, std::chrono::steady_clock::time_point deadline)
     {
         NULL_GUARD(m_client);
-        packet p(packet::type_connect,m_nsp);
-        m_client->send(p);
-        m_connection_timer.reset(new asio::steady_timer(m_client->get_io_service()));
-        asio::error_code ec;
-        m_connection_timer->expires_from_now(std::chrono::milliseconds(20000), ec);
-        m_connection_timer->async_wait(std::bind(&socket_impl::timeout_connection,this, std::placeholders::_1));
+        packet p(m_nsp, std::move(msg), add_ack(ack));
+        p.set_compress(compress);
+        send_packet(p, is_volatile, deadline);
     }
-    
-    void socket_impl::close()
+
+    void socket_impl::emit_with_ack(std::string const& name, message::list const& msglist, ack_listener const& ack, unsigned timeout_millis)
     {
         NULL_GUARD(m_client);
-        if(m_connected)
+        pending_ack entry;
+        entry.listener = ack;
+        entry.deadline = timeout_millis > 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_millis)
+                                            : std::chrono::steady_clock::time_point::max();
+        packet p(m_nsp, msglist.to_array_message(name), add_ack(std::move(entry)));
+        send_packet(p);
+    }
+
+    int socket_impl::add_ack(std::function<void (message::list const&)> const& ack)
+    {
+        if(!ack)
         {
-            packet p(packet::type_disconnect,m_nsp);
-            send_packet(p);
-            
-            if(!m_connection_timer)
-            {
-                m_connection_timer.reset(new asio::steady_timer(m_client->get_io_service()));
-            }
-            asio::error_code ec;
-            m_connection_timer->expires_from_now(std::chrono::milliseconds(3000), ec);
-            m_connection_timer->async_wait(std::bind(&socket_impl::on_close, this));
+            return -1;
         }
+        pending_ack entry;
+        //without a status, a failure reaches a plain ack as an empty response.
+        entry.listener = [ack](ack_status, message::list const& response) { ack(response); };
+        entry.deadline = std::chrono::steady_clock::time_point::max();
+        return add_ack(std::move(entry));
     }
-    
-    void socket_impl::on_connected()
+
+    int socket_impl::add_ack(pending_ack&& entry)
     {
-        if(m_connection_timer)
+        if(!entry.listener)
         {
-            m_connection_timer->cancel();
-            m_connection_timer.reset();
+            return -1;
         }
-        if(!m_connected)
+        int pack_id = (int)(m_next_ack_id.fetch_add(1, std::memory_order_relaxed) & INT_MAX);
+        std::chrono::steady_clock::time_point deadline = entry.deadline;
+        bool earliest = false;
         {
-            m_connected = true;
-            m_client->on_socket_opened(m_nsp);
+            std::lock_guard<std::mutex> guard(m_ack_mutex);
+            m_acks[pack_id] = std::move(entry);
+            if(deadline != std::chrono::steady_clock::time_point::max())
+            {
+                earliest = m_ack_deadlines.empty() || deadline < m_ack_deadlines.top().first;
+                m_ack_deadlines.push(ack_deadline(deadline, pack_id));
+            }
+        }
+        client_base* client = get_client();
+        if(earliest && client)
+        {
+            client->get_io_service().dispatch(std::bind(&socket_impl::arm_ack_timer, shared_from_this()));
+        }
+        return pack_id;
+    }
 
-            while (true) {
-				m_packet_mutex.lock();
-				if(m_packet_queue.empty())
-				{
-					m_packet_mutex.unlock();
-					return;
-				}
-				sio::packet front_pack = std::move(m_packet_queue.front());
-                m_packet_queue.pop();
-				m_packet_mutex.unlock();
-				m_client->send(front_pack);
+    void socket_impl::erase_ack(int msgId)
+    {
+        std::lock_guard<std::mutex> guard(m_ack_mutex);
+        m_acks.erase(msgId);
+    }
+
+    void socket_impl::arm_ack_timer()
+    {
+        NULL_GUARD(m_client);
+        std::chrono::steady_clock::time_point deadline;
+        {
+            std::lock_guard<std::mutex> guard(m_ack_mutex);
+            if(m_ack_deadlines.empty())
+            {
+                return;
+            }
+            deadline = m_ack_deadlines.top().first;
+        }
+        if(!m_ack_timer)
+        {
+            m_ack_timer.reset(new asio::steady_timer(get_client()->get_io_service()));
+        }
+        asio::error_code ec;
+        m_ack_timer->expires_at(deadline, ec);
+        m_ack_timer->async_wait(std::bind(&socket_impl::timeout_acks, shared_from_this(), std::placeholders::_1));
+    }
+
+    void socket_impl::timeout_acks(const asio::error_code &ec)
+    {
+        if(ec)
+        {
+            return;
+        }
+        std::vector<ack_listener> expired;
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> guard(m_ack_mutex);
+            while(!m_ack_deadlines.empty() && m_ack_deadlines.top().first <= now)
+            {
+                auto it = m_acks.find(m_ack_deadlines.top().second);
+                //the id may have been answered, or reused by a newer ack once the counter wrapped.
+                if(it != m_acks.end() && it->second.deadline == m_ack_deadlines.top().first)
+                {
+                    expired.push_back(std::move(it->second.listener));
+                    m_acks.erase(it);
+                }
+                m_ack_deadlines.pop();
+            }
+        }
+        for(auto it = expired.begin(); it != expired.end(); ++it)
+        {
+            deliver_ack(get_client(), std::bind(*it, ack_timeout, message::list()));
+        }
+        arm_ack_timer();
+    }
+
+    void socket_impl::fail_acks(client_base* client)
+    {
+        std::unordered_map<int, pending_ack> acks;
+        {
+            std::lock_guard<std::mutex> guard(m_ack_mutex);
+            acks.swap(m_acks);
+            m_ack_deadlines = std::priority_queue<ack_deadline, std::vector<ack_deadline>, std::greater<ack_deadline> >();
+        }
+        if(m_ack_timer)
+        {
+            //the timer belongs to the client's io_service, which may go away before this socket.
+            asio::error_code ec;
+            m_ack_timer->cancel(ec);
+            m_ack_timer.reset();
+        }
+        for(auto it = acks.begin(); it != acks.end(); ++it)
+        {
+            deliver_ack(client, std::bind(it->second.listener, ack_disconnected, message::list()));
+        }
+    }
+
+    void socket_impl::deliver_ack(client_base* client, std::function<void()> const& callback)
+    {
+        if(client && client->get_dispatcher())
+        {
+            client->get_dispatcher()->post(m_nsp, std::bind(&socket_impl::run_ack, shared_from_this(), callback));
+            return;
+        }
+        callback();
+    }
+
+    void socket_impl::run_ack(std::function<void()> const& callback)
+    {
+        listener_scope scope;
+        callback();
+    }
+
+    socket::drop_stats socket_impl::get_drop_stats() const
+    {
+        drop_stats stats;
+        stats.volatile_dropped = m_volatile_dropped.load(std::memory_order_relaxed);
+        stats.expired = m_expired.load(std::memory_order_relaxed);
+        stats.conflated = m_conflated.load(std::memory_order_relaxed);
+        stats.offline_dropped = m_offline_dropped.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void socket_impl::set_offline_limits(size_t max_bytes, size_t max_packets, overflow_policy policy)
+    {
+        m_offline_max_bytes.store(max_bytes, std::memory_order_relaxed);
+        m_offline_max_packets.store(max_packets, std::memory_order_relaxed);
+        m_overflow_policy.store(policy, std::memory_order_relaxed);
+        if(policy != overflow_block)
+        {
+            std::lock_guard<std::mutex> guard(m_offline_mutex);
+            m_offline_blocking = false;
+            m_offline_cond.notify_all();
+        }
+    }
+
+    bool socket_impl::offline_full() const
+    {
+        size_t max_packets = m_offline_max_packets.load(std::memory_order_relaxed);
+        size_t max_bytes = m_offline_max_bytes.load(std::memory_order_relaxed);
+        return (max_packets > 0 && m_packet_queue.size() >= max_packets)
+            || (max_bytes > 0 && m_offline_bytes.load(std::memory_order_relaxed) >= max_bytes);
+    }
+
+    void socket_impl::update_offline_blocking()
+    {
+        //only the offline queue blocks producers, packets sent while connected never do.
+        bool blocking = m_overflow_policy.load(std::memory_order_relaxed) == overflow_block && offline_full();
+        std::lock_guard<std::mutex> guard(m_offline_mutex);
+        if(m_offline_blocking != blocking)
+        {
+            m_offline_blocking = blocking;
+            if(!blocking)
+            {
+                m_offline_cond.notify_all();
             }
         }
     }
+
+    void socket_impl::emit_conflated(std::string const& name, std::string const& key, message::list const& msglist)
+    {
+        NULL_GUARD(m_client);
+        std::shared_ptr<packet> p = std::make_shared<packet>(m_nsp, msglist.to_array_message(name));
+        std::string slot_key;
+        slot_key.reserve(name.size() + key.size() + 1);
+        slot_key.append(name).push_back('\0');
+        slot_key.append(key);
+        std::shared_ptr<conflation_slot> slot;
+        {
+            std::lock_guard<std::mutex> guard(m_conflation_mutex);
+            std::shared_ptr<conflation_slot>& entry = m_conflation_slots[slot_key];
+            if(entry)
+            {
+                //the slot is already queued, it now carries the newer packet.
+                entry->pending = std::move(p);
+                m_conflated.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            entry = std::make_shared<conflation_slot>();
+            entry->key = std::move(slot_key);
+            entry->pending = std::move(p);
+            slot = entry;
+        }
+        m_buffered_packets.fetch_add(1, std::memory_order_relaxed);
+        m_outbound.push(outbound_packet(slot));
+        schedule_drain();
+    }
+    
+    void socket_impl::send_connect()
+    {
+        NULL_GUARD(m_client);
+        packet p(packet::type_connect,m_nsp);
+        get_client()->send(p);
+        m_connection_timer.reset(new asio::steady_timer(get_client()->get_io_service()));
+        asio::error_code ec;
+        m_connection_timer->expires_from_now(std::chrono::milliseconds(20000), ec);
+        m_connection_timer->async_wait(std::bind(&socket_impl::timeout_connection,shared_from_this(), std::placeholders::_1));
+    }
+    
+    void socket_impl::close()
+    {
+        NULL_GUARD(m_client);
+        if(m_connected)
+        {
+            packet p(packet::type_disconnect,m_nsp);
+            send_packet(p);
+            
+            if(!m_connection_timer)
+            {
+                m_connection_timer.reset(new asio::steady_timer(get_client()->get_io_service()));
+            }
+            asio::error_code ec;
+            m_connection_timer->expires_from_now(std::chrono::milliseconds(3000), ec);
+            m_connection_timer->async_wait(std::bind(&socket_impl::on_close, shared_from_this()));
+        }
+    }
+    
+    void socket_impl::on_connected()
+    {
+        if(m_connection_timer)
+        {
+            m_connection_timer->cancel();
+            m_connection_timer.reset();
+        }
+        if(!m_connected)
+        {
+            m_connected = true;
+            get_client()->on_socket_opened(m_nsp);
+            flush_offline();
+        }
+    }
     
     void socket_impl::on_close()
     {
         NULL_GUARD(m_client);
-        auto client = m_client;
-        m_client = NULL;
+        client_base* client = m_client.exchange(NULL, std::memory_order_acq_rel);
 
         if(m_connection_timer)
         {
@@ -328,12 +999,9 @@ namespace sio
             m_connection_timer.reset();
         }
         m_connected = false;
-		{
-			std::lock_guard<std::mutex> guard(m_packet_mutex);
-			while (!m_packet_queue.empty()) {
-				m_packet_queue.pop();
-			}
-		}
+        fail_acks(client);
+        discard_outbound();
+        discard_offline();
         client->on_socket_closed(m_nsp);
         client->remove_socket(m_nsp);
     }
@@ -349,14 +1017,12 @@ namespace sio
         if(m_connected)
         {
             m_connected = false;
-			std::lock_guard<std::mutex> guard(m_packet_mutex);
-            while (!m_packet_queue.empty()) {
-                m_packet_queue.pop();
-            }
+            fail_acks(get_client());
+            discard_offline();
         }
     }
     
-    void socket_impl::on_message_packet(packet const& p)
+    void socket_impl::on_message_packet(packet&& p)
     {
         NULL_GUARD(m_client);
         if(p.get_nsp() == m_nsp)
@@ -366,34 +1032,33 @@ namespace sio
             // Connect open
             case packet::type_connect:
             {
-                m_client->log("Received Message type (Connect)");
+                get_client()->log("Received Message type (Connect)");
 
                 this->on_connected();
                 break;
             }
             case packet::type_disconnect:
             {
-                m_client->log("Received Message type (Disconnect)");
+                get_client()->log("Received Message type (Disconnect)");
                 this->on_close();
                 break;
             }
             case packet::type_event:
             case packet::type_binary_event:
             {
-                m_client->log("Received Message type (Event)");
-                const message::ptr ptr = p.get_message();
-                if(ptr->get_flag() == message::flag_array)
+                get_client()->log("Received Message type (Event)");
+                if(p.has_event_name())
                 {
-                    const array_message* array_ptr = static_cast<const array_message*>(ptr.get());
-                    if(array_ptr->get_vector().size() >= 1&&array_ptr->get_vector()[0]->get_flag() == message::flag_string)
+                    this->on_socketio_event(std::move(p));
+                    break;
+                }
+                message::ptr ptr = p.take_message();
+                if(ptr && ptr->get_flag() == message::flag_array)
+                {
+                    if(ptr->get_vector().size() >= 1&&ptr->get_vector()[0]->get_flag() == message::flag_string)
                     {
-                        const string_message* name_ptr = static_cast<const string_message*>(array_ptr->get_vector()[0].get());
-                        message::list mlist;
-                        for(size_t i = 1;i<array_ptr->get_vector().size();++i)
-                        {
-                            mlist.push(array_ptr->get_vector()[i]);
-                        }
-                        this->on_socketio_event(p.get_nsp(), p.get_pack_id(),name_ptr->get_string(), std::move(mlist));
+                        message::ptr name_ptr = ptr->get_vector()[0];
+                        this->on_socketio_event(p.get_nsp(), p.get_pack_id(),name_ptr->get_string(), take_arguments(std::move(ptr), 1));
                     }
                 }
 
@@ -403,23 +1068,22 @@ namespace sio
             case packet::type_ack:
             case packet::type_binary_ack:
             {
-                m_client->log("Received Message type (ACK)");
-                const message::ptr ptr = p.get_message();
+                get_client()->log("Received Message type (ACK)");
+                message::ptr ptr = p.take_message();
                 if(ptr->get_flag() == message::flag_array)
                 {
-					message::list msglist(ptr->get_vector());
-					this->on_socketio_ack(p.get_pack_id(),msglist);
+					this->on_socketio_ack(p.get_pack_id(),take_arguments(std::move(ptr), 0));
                 }
 				else
 				{
-					this->on_socketio_ack(p.get_pack_id(),message::list(ptr));
+					this->on_socketio_ack(p.get_pack_id(),message::list(std::move(ptr)));
 				}
                 break;
             }
                 // Error
             case packet::type_error:
             {
-                m_client->log("Received Message type (ERROR)");
+                get_client()->log("Received Message type (ERROR)");
                 this->on_socketio_error(p.get_message());
                 break;
             }
@@ -432,34 +1096,136 @@ namespace sio
     void socket_impl::on_socketio_event(const std::string& nsp,int msgId,const std::string& name, message::list && message)
     {
         bool needAck = msgId >= 0;
+        std::shared_ptr<const listener_table> table = std::atomic_load(&m_listeners);
+        listener_table::entry const* listener = table->find(name);
+        if(get_client()->get_dispatcher())
+        {
+            dispatch_event(table, listener, event_adapter::create_shared_event(nsp,name,std::move(message),needAck), msgId, false);
+            return;
+        }
         event ev = event_adapter::create_event(nsp,name, std::move(message),needAck);
-        event_listener func = this->get_bind_listener_locked(name);
-        if(func)func(ev);
+        if(listener)listener->invoke(ev);
         if(needAck)
         {
-            this->ack(msgId, name, ev.get_ack_message());
+            this->ack(msgId, name, std::move(event_adapter::get_ack_message(ev)));
         }
     }
     
-    void socket_impl::ack(int msgId, const string &, const message::list &ack_message)
+    void socket_impl::on_socketio_event(packet&& p)
     {
-        packet p(m_nsp, ack_message.to_array_message(),msgId,true);
+        int msgId = p.get_pack_id();
+        bool needAck = msgId >= 0;
+        string const& name = p.get_event_name();
+        std::shared_ptr<const listener_table> table = std::atomic_load(&m_listeners);
+        listener_table::entry const* listener = table->find(name);
+        if(!listener)
+        {
+            //nothing to decode the body for, and nothing to answer but an empty ack.
+            m_unbound.count(false);
+            if(needAck)
+            {
+                this->ack(msgId, name, message::list());
+            }
+            return;
+        }
+        //the body stays undecoded until the listener asks for it.
+        std::shared_ptr<packet> body = std::make_shared<packet>(std::move(p));
+        if(get_client()->get_dispatcher())
+        {
+            dispatch_event(table, listener, event_adapter::create_shared_event(body->get_nsp(),body->get_event_name(),std::move(body),needAck), msgId, true);
+            return;
+        }
+        event ev = event_adapter::create_event(body->get_nsp(),body->get_event_name(),std::move(body),needAck);
+        listener->invoke(ev);
+        count_decode(listener, event_adapter::body_decoded(ev));
+        if(needAck)
+        {
+            this->ack(msgId, ev.get_name(), std::move(event_adapter::get_ack_message(ev)));
+        }
+    }
+
+    void socket_impl::dispatch_event(std::shared_ptr<const listener_table> const& table, listener_table::entry const* listener, std::shared_ptr<event> const& ev, int msgId, bool lazy)
+    {
+        //the listener lives in table, which the task owns until it runs off the network thread.
+        std::string key = m_nsp;
+        if(get_client()->get_dispatch_order() == client::dispatch_by_event)
+        {
+            key.push_back('\0');
+            key.append(ev->get_name());
+        }
+        get_client()->get_dispatcher()->post(key, std::bind(&socket_impl::run_listener, shared_from_this(), table, listener, ev, msgId, lazy));
+    }
+
+    void socket_impl::run_listener(std::shared_ptr<const listener_table> const&, listener_table::entry const* listener,
+                                   std::shared_ptr<event> const& ev, int msgId, bool lazy)
+    {
+        listener_scope scope;
+        if(listener)listener->invoke(*ev);
+        if(lazy)
+        {
+            count_decode(listener, event_adapter::body_decoded(*ev));
+        }
+        if(msgId >= 0)
+        {
+            //the ack goes out through the outbound queue, which takes packets from any thread.
+            this->ack(msgId, ev->get_name(), std::move(event_adapter::get_ack_message(*ev)));
+        }
+    }
+
+    void socket_impl::count_decode(listener_table::entry const* listener, bool decoded)
+    {
+        //bound events count in their table entry, neither takes a lock.
+        (listener ? *listener->stats : m_unbound).count(decoded);
+    }
+
+    std::shared_ptr<decode_counter> const& socket_impl::get_decode_counter(string const& event)
+    {
+        std::lock_guard<std::mutex> guard(m_stats_mutex);
+        std::shared_ptr<decode_counter>& counter = m_decode_counters[event];
+        if(!counter)
+        {
+            counter = std::make_shared<decode_counter>();
+        }
+        return counter;
+    }
+
+    std::map<std::string, socket::decode_stats> socket_impl::get_decode_stats() const
+    {
+        std::map<std::string, decode_stats> result;
+        std::lock_guard<std::mutex> guard(m_stats_mutex);
+        for(auto it = m_decode_counters.begin(); it != m_decode_counters.end(); ++it)
+        {
+            decode_stats& stats = result[it->first];
+            stats.decoded = it->second->decoded.load(std::memory_order_relaxed);
+            stats.skipped = it->second->skipped.load(std::memory_order_relaxed);
+        }
+        uint64_t unbound = m_unbound.skipped.load(std::memory_order_relaxed);
+        if(unbound > 0)
+        {
+            result[std::string()].skipped += unbound;
+        }
+        return result;
+    }
+
+    void socket_impl::ack(int msgId, const string &, message::list&& ack_message)
+    {
+        packet p(m_nsp, std::move(ack_message).to_array_message(),msgId,true);
         send_packet(p);
     }
     
     void socket_impl::on_socketio_ack(int msgId, message::list const& message)
     {
-        std::function<void (message::list const&)> l;
+        pending_ack entry;
         {
-            std::lock_guard<std::mutex> guard(m_event_mutex);
+            std::lock_guard<std::mutex> guard(m_ack_mutex);
             auto it = m_acks.find(msgId);
             if(it!=m_acks.end())
             {
-                l = it->second;
+                entry = std::move(it->second);
                 m_acks.erase(it);
             }
         }
-        if(l)l(message);
+        if(entry.listener)deliver_ack(get_client(), std::bind(entry.listener, ack_received, message));
     }
     
     void socket_impl::on_socketio_error(message::ptr const& err_message)
@@ -475,55 +1241,420 @@ namespace sio
             return;
         }
         m_connection_timer.reset();
-        m_client->log("Connection timeout,close socket.");
+        get_client()->log("Connection timeout,close socket.");
         //Should close socket if no connected message arrive.Otherwise we'll never ask for open again.
         this->on_close();
     }
     
-    void socket_impl::send_packet(sio::packet &p)
+    void socket_impl::emit_async(std::string const& name, message::list&& msglist, std::function<void (message::list const&)> const& ack, emit_listener const& done)
     {
-        NULL_GUARD(m_client);
-        if(m_connected)
+        client_base* client = get_client();
+        if(!client)
         {
-            while (true) {
-				m_packet_mutex.lock();
-				if(m_packet_queue.empty())
-				{
-					m_packet_mutex.unlock();
-					break;
-				}
-				sio::packet front_pack = std::move(m_packet_queue.front());
+            if(done) done(false);
+            return;
+        }
+        std::shared_ptr<encode_job> job = std::make_shared<encode_job>();
+        job->pack = packet(m_nsp, std::move(msglist).to_array_message(name), add_ack(ack));
+        job->callback = done;
+        worker_pool* pool = client->get_encode_pool();
+        job->offloaded = pool != NULL;
+        if(pool)
+        {
+            job->codec = client->get_codec();
+        }
+        outbound_packet p;
+        p.pack_id = (int)job->pack.get_pack_id();
+        p.job = job;
+        push_outbound(std::move(p));
+        if(pool)
+        {
+            pool->submit(std::bind(&socket_impl::encode_async, shared_from_this(), job));
+        }
+    }
+
+    void socket_impl::encode_async(std::shared_ptr<encode_job> const& job)
+    {
+        client_base::encode(*job->codec, job->pack, job->frames);
+        job->done.store(true, std::memory_order_release);
+        //the client joins its encode workers before closing its sockets, so it is alive while m_client is set.
+        schedule_drain();
+    }
+
+    void socket_impl::send_packet(sio::packet &p, bool is_volatile, std::chrono::steady_clock::time_point deadline)
+    {
+        push_outbound(outbound_packet(std::move(p), is_volatile, deadline));
+    }
+
+    void socket_impl::push_outbound(outbound_packet&& p)
+    {
+        client_base* client = get_client();
+        NULL_GUARD(client);
+        if(client->on_network_thread())
+        {
+            //a polling thread or a listener emitting with nothing queued ahead sends without a trip through the queue.
+            if(!m_encoding_head && m_outbound.empty() && m_packet_queue.empty() && !(p.job && p.job->offloaded))
+            {
+                m_buffered_packets.fetch_add(1, std::memory_order_relaxed);
+                if(p.job)
+                {
+                    adopt_frames(p);
+                }
+                route_outbound(p, std::chrono::steady_clock::now());
+                check_watermarks();
+                return;
+            }
+        }
+        else if(!t_running_listener && !p.is_volatile && m_overflow_policy.load(std::memory_order_relaxed) == overflow_block)
+        {
+            //the network thread must never wait for itself, it is the one making room.
+            //nor a listener, the events queued behind it in its dispatcher would wait as well.
+            std::unique_lock<std::mutex> lock(m_offline_mutex);
+            while(m_offline_blocking)
+            {
+                m_offline_cond.wait(lock);
+            }
+        }
+        m_buffered_packets.fetch_add(1, std::memory_order_relaxed);
+        m_outbound.push(std::move(p));
+        schedule_drain();
+    }
+
+    void socket_impl::schedule_drain()
+    {
+        client_base* client = get_client();
+        NULL_GUARD(client);
+        //only the producer that finds no drain pending wakes the network thread.
+        if(!m_drain_scheduled.exchange(true, std::memory_order_acq_rel))
+        {
+            client->get_io_service().post(std::bind(&socket_impl::drain_outbound, shared_from_this()));
+        }
+    }
+
+    void socket_impl::drain_outbound()
+    {
+        do
+        {
+            m_drain_scheduled.store(false, std::memory_order_release);
+            NULL_GUARD(m_client);
+            outbound_packet p;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            while(take_outbound(p))
+            {
+                route_outbound(p, now);
+            }
+            check_watermarks();
+            //a producer may have pushed after the last pop, but seen the drain still scheduled.
+            //a head still encoding schedules the drain itself once done.
+        }
+        while(!m_encoding_head && !m_outbound.empty() && !m_drain_scheduled.exchange(true, std::memory_order_acq_rel));
+    }
+
+    bool socket_impl::take_outbound(outbound_packet& p)
+    {
+        if(m_encoding_head)
+        {
+            if(!m_encoding_head->job->done.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            p = std::move(*m_encoding_head);
+            m_encoding_head.reset();
+        }
+        else if(!m_outbound.pop(p))
+        {
+            return false;
+        }
+        if(p.job)
+        {
+            if(p.job->offloaded && !p.job->done.load(std::memory_order_acquire))
+            {
+                //packets emitted after it wait, whatever thread emitted them.
+                m_encoding_head.reset(new outbound_packet(std::move(p)));
+                return false;
+            }
+            adopt_frames(p);
+        }
+        return true;
+    }
+
+    void socket_impl::adopt_frames(outbound_packet& p)
+    {
+        if(!p.job->done.load(std::memory_order_acquire))
+        {
+            get_client()->encode(p.job->pack, p.job->frames);
+        }
+        p.frames = std::move(p.job->frames);
+        p.job->pack = packet();
+    }
+
+    void socket_impl::route_outbound(outbound_packet& p, std::chrono::steady_clock::time_point now)
+    {
+        if(drop_stale(p, now))
+        {
+            m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        }
+        else if(m_connected)
+        {
+            flush_offline();
+            send_outbound(p);
+            m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            push_offline(std::move(p));
+        }
+    }
+
+    void socket_impl::complete(outbound_packet const& p, bool sent)
+    {
+        if(p.job && p.job->callback)
+        {
+            p.job->callback(sent);
+        }
+    }
+
+    void socket_impl::flush_offline()
+    {
+        if(m_packet_queue.empty())
+        {
+            return;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while (!m_packet_queue.empty()) {
+            if(!drop_stale(m_packet_queue.front(), now))
+            {
+                send_outbound(m_packet_queue.front());
+            }
+            m_offline_bytes.fetch_sub(m_packet_queue.front().bytes, std::memory_order_relaxed);
+            m_packet_queue.pop();
+            m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        }
+        update_offline_blocking();
+        check_watermarks();
+    }
+
+    void socket_impl::push_offline(outbound_packet&& p)
+    {
+        if(p.slot)
+        {
+            //encoded like other packets, so it counts in the offline bytes. A newer emit replaces the frames when sent.
+            std::shared_ptr<packet> latest;
+            {
+                std::lock_guard<std::mutex> guard(m_conflation_mutex);
+                latest = std::move(p.slot->pending);
+            }
+            if(latest)
+            {
+                get_client()->encode(*latest, p.frames);
+            }
+        }
+        else if(p.frames.empty())
+        {
+            //keep the encoded frames only, they are far smaller than the message tree.
+            get_client()->encode(p.pack, p.frames);
+            p.pack = packet();
+        }
+        for(auto it = p.frames.begin(); it != p.frames.end(); ++it)
+        {
+            p.bytes += it->payload->size();
+        }
+        size_t max_packets = m_offline_max_packets.load(std::memory_order_relaxed);
+        size_t max_bytes = m_offline_max_bytes.load(std::memory_order_relaxed);
+        overflow_policy policy = m_overflow_policy.load(std::memory_order_relaxed);
+        bool full = (max_packets > 0 && m_packet_queue.size() >= max_packets)
+            || (max_bytes > 0 && m_offline_bytes.load(std::memory_order_relaxed) + p.bytes > max_bytes);
+        if(full && policy == overflow_drop_newest)
+        {
+            drop_outbound(p);
+            return;
+        }
+        m_offline_bytes.fetch_add(p.bytes, std::memory_order_relaxed);
+        m_packet_queue.push(std::move(p));
+        if(full && policy == overflow_drop_oldest)
+        {
+            while(m_packet_queue.size() > 1 &&
+                  ((max_packets > 0 && m_packet_queue.size() > max_packets)
+                   || (max_bytes > 0 && m_offline_bytes.load(std::memory_order_relaxed) > max_bytes)))
+            {
+                m_offline_bytes.fetch_sub(m_packet_queue.front().bytes, std::memory_order_relaxed);
+                drop_outbound(m_packet_queue.front());
                 m_packet_queue.pop();
-				m_packet_mutex.unlock();
-				m_client->send(front_pack);
             }
-            m_client->send(p);
+        }
+        else if(policy == overflow_block)
+        {
+            update_offline_blocking();
+        }
+    }
+
+    void socket_impl::drop_outbound(outbound_packet& p)
+    {
+        m_offline_dropped.fetch_add(1, std::memory_order_relaxed);
+        m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        if(p.slot)
+        {
+            take_conflated(*p.slot);
+        }
+        complete(p, false);
+        if(p.pack_id >= 0)
+        {
+            erase_ack(p.pack_id);
+        }
+    }
+
+    void socket_impl::send_outbound(outbound_packet& p)
+    {
+        if(p.slot)
+        {
+            std::shared_ptr<packet> latest = take_conflated(*p.slot);
+            if(latest)
+            {
+                //emitted again since the slot was encoded offline.
+                p.frames.clear();
+                get_client()->encode(*latest, p.frames);
+            }
+        }
+        else if(p.frames.empty())
+        {
+            get_client()->encode(p.pack, p.frames);
+        }
+        if(!p.frames.empty())
+        {
+            std::function<void()> expired;
+            if(p.deadline != std::chrono::steady_clock::time_point::max())
+            {
+                expired = std::bind(&socket_impl::expire_bulk, shared_from_this(), p.pack_id);
+            }
+            get_client()->send_frames(m_nsp, p.frames, p.deadline, expired);
+        }
+        complete(p, true);
+    }
+
+    std::shared_ptr<packet> socket_impl::take_conflated(conflation_slot& slot)
+    {
+        //the key is free again once its packet leaves the queue, the next emit for it gets a new slot.
+        std::lock_guard<std::mutex> guard(m_conflation_mutex);
+        auto it = m_conflation_slots.find(slot.key);
+        if(it != m_conflation_slots.end() && it->second.get() == &slot)
+        {
+            m_conflation_slots.erase(it);
+        }
+        return std::move(slot.pending);
+    }
+
+    void socket_impl::expire_bulk(int pack_id)
+    {
+        //timed out in the client's bulk lane instead of the outbound queue.
+        m_expired.fetch_add(1, std::memory_order_relaxed);
+        if(pack_id >= 0)
+        {
+            erase_ack(pack_id);
+        }
+    }
+
+    void socket_impl::discard_offline()
+    {
+        while (!m_packet_queue.empty()) {
+            //empties conflation slots too, so the next emit for their key queues them again.
+            drop_outbound(m_packet_queue.front());
+            m_packet_queue.pop();
+        }
+        m_offline_bytes.store(0, std::memory_order_relaxed);
+        update_offline_blocking();
+        check_watermarks();
+    }
+
+    void socket_impl::discard_outbound()
+    {
+        //packets never taken by the network thread fail too, emit_async callbacks always hear back.
+        if(m_encoding_head)
+        {
+            complete(*m_encoding_head, false);
+            m_encoding_head.reset();
+            m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        }
+        outbound_packet p;
+        while(m_outbound.pop(p))
+        {
+            if(p.slot)
+            {
+                take_conflated(*p.slot);
+            }
+            complete(p, false);
+            m_buffered_packets.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool socket_impl::drop_stale(outbound_packet const& p, std::chrono::steady_clock::time_point now)
+    {
+        if(p.is_volatile)
+        {
+            if(m_connected && get_client()->transport_buffered_amount() <= m_volatile_threshold)
+            {
+                return false;
+            }
+            m_volatile_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if(now > p.deadline)
+        {
+            m_expired.fetch_add(1, std::memory_order_relaxed);
         }
         else
         {
-			std::lock_guard<std::mutex> guard(m_packet_mutex);
-            m_packet_queue.push(p);
+            return false;
+        }
+        //the ack of a dropped event will never come.
+        if(p.pack_id >= 0)
+        {
+            erase_ack(p.pack_id);
         }
+        complete(p, false);
+        return true;
     }
-    
-    socket::event_listener socket_impl::get_bind_listener_locked(const string &event)
+
+    void socket_impl::check_watermarks()
     {
-        std::lock_guard<std::mutex> guard(m_event_mutex);
-        auto it = m_event_binding.find(event);
-        if(it!=m_event_binding.end())
+        if(m_high_watermark == 0)
         {
-            return it->second;
+            return;
+        }
+        size_t buffered = m_buffered_packets.load(std::memory_order_relaxed);
+        if(!m_above_high_watermark && buffered >= m_high_watermark)
+        {
+            m_above_high_watermark = true;
+            if(m_high_watermark_listener) m_high_watermark_listener();
+        }
+        else if(m_above_high_watermark && buffered <= m_low_watermark)
+        {
+            m_above_high_watermark = false;
+            if(m_low_watermark_listener) m_low_watermark_listener();
         }
-        return socket::event_listener();
     }
     
+    
     socket::~socket()
     {
     }
  
+    prepared_event::~prepared_event()
+    {
+    }
+
+    prepared_event::ptr prepared_event::create(std::string const& name, message::list const& msglist)
+    {
+        return std::make_shared<prepared_event_impl>(name, msglist.to_array_message(name));
+    }
+
     socket::ptr socket::create(client_base* client, std::string const& nsp)
     {
-        return std::make_shared<socket_impl>(client, nsp);
+        std::shared_ptr<socket_impl> s = std::make_shared<socket_impl>(client, nsp);
+        //the connection timer keeps the socket alive, so it is owned before the connect goes out.
+        if(client && client->opened())
+        {
+            s->send_connect();
+        }
+        return s;
     }
 
 }
@@ -2,9 +2,11 @@
 #define SIO_SOCKET_H
 #include "sio_message.h"
 #include <functional>
+#include <cstdint>
 namespace sio
 {
     class event_adapter;
+    class packet;
 
     class SIO_API event
     {
@@ -21,18 +23,25 @@ namespace sio
 
         void put_ack_message(message::list const& ack_message);
 
+        void put_ack_message(message::list&& ack_message);
+
         message::list const& get_ack_message() const;
 
     protected:
         event(std::string const& nsp, std::string const& name, message::list const& messages, bool need_ack);
         event(std::string const& nsp, std::string const& name, message::list&& messages, bool need_ack);
+        event(std::string const& nsp, std::string const& name, std::shared_ptr<packet>&& body, bool need_ack);
 
         message::list& get_ack_message_impl();
 
     private:
+        void decode_body() const;
+
         const std::string m_nsp;
         const std::string m_name;
-        const message::list m_messages;
+        mutable message::list m_messages;
+        //undecoded packet, the messages are taken from it on first access.
+        mutable std::shared_ptr<packet> m_body;
         const bool m_need_ack;
         message::list m_ack_message;
 
@@ -40,7 +49,29 @@ namespace sio
     };
 
     class client_base;
-    class packet;
+
+    // An event whose arguments are serialized once, on its first emit, then emitted any number of times,
+    // on any socket, without encoding them again. Only the namespace and ack id are written per emit.
+    class SIO_API prepared_event
+    {
+    public:
+        typedef std::shared_ptr<const prepared_event> ptr;
+
+        static ptr create(std::string const& name, message::list const& msglist = nullptr);
+
+        virtual ~prepared_event();
+
+        virtual std::string const& get_name() const = 0;
+
+        virtual message::ptr const& get_message() const = 0;
+
+    protected:
+        prepared_event() {}
+    private:
+        //disable copy constructor and assign operator.
+        prepared_event(prepared_event const&);
+        void operator=(prepared_event const&);
+    };
 
     //The name 'socket' is taken from concept of official socket.io.
     class SIO_API socket
@@ -52,8 +83,52 @@ namespace sio
 
         typedef std::function<void(message::ptr const& message)> error_listener;
 
+        typedef std::function<void()> watermark_listener;
+
+        // How an ack requested by emit_with_ack ended.
+        enum ack_status
+        {
+            ack_received,
+            ack_timeout,
+            ack_disconnected
+        };
+
+        typedef std::function<void(ack_status status, message::list const& response)> ack_listener;
+
+        // Called once an event of emit_async is handed to the client (sent = true), or when it is dropped.
+        typedef std::function<void(bool sent)> emit_listener;
+
         typedef std::shared_ptr<socket> ptr;
 
+        // Number of event bodies decoded for a listener, and skipped because no listener asked for them.
+        struct decode_stats
+        {
+            decode_stats():decoded(0),skipped(0){}
+
+            uint64_t decoded;
+            uint64_t skipped;
+        };
+
+        // Number of volatile events dropped, of events dropped when their ttl expired,
+        // of conflated events replaced by a newer one before being sent, and of events dropped by the offline queue.
+        struct drop_stats
+        {
+            drop_stats():volatile_dropped(0),expired(0),conflated(0),offline_dropped(0){}
+
+            uint64_t volatile_dropped;
+            uint64_t expired;
+            uint64_t conflated;
+            uint64_t offline_dropped;
+        };
+
+        // What happens to an emit when the offline queue is full.
+        enum overflow_policy
+        {
+            overflow_drop_oldest,
+            overflow_drop_newest,
+            overflow_block
+        };
+
         virtual ~socket();
 
         virtual void on(std::string const& event_name, event_listener const& func) = 0;
@@ -70,10 +145,60 @@ namespace sio
 
         virtual void off_error() = 0;
 
-        virtual void emit(std::string const& name, message::list const& msglist = nullptr, std::function<void(message::list const&)> const& ack = nullptr) = 0;
+        // compress = false sends the event uncompressed even when permessage-deflate is negotiated.
+        virtual void emit(std::string const& name, message::list const& msglist = nullptr, std::function<void(message::list const&)> const& ack = nullptr, bool compress = true) = 0;
+
+        // Moves the messages of msglist into the packet instead of sharing them.
+        virtual void emit(std::string const& name, message::list&& msglist, std::function<void(message::list const&)> const& ack = nullptr, bool compress = true) = 0;
+
+        // Returns without encoding: msglist is encoded on the client's encode pool, or on the network thread.
+        // Events still reach the wire in emit order with the other emits of this socket.
+        virtual void emit_async(std::string const& name, message::list&& msglist, std::function<void(message::list const&)> const& ack = nullptr, emit_listener const& done = nullptr) = 0;
+
+        // The arguments of event must not be modified once it has been emitted.
+        virtual void emit_prepared(prepared_event::ptr const& event, std::function<void(message::list const&)> const& ack = nullptr, bool compress = true) = 0;
+
+        // ack is called once: with the response, when timeout_millis (0 for none) elapses first,
+        // or when the namespace disconnects before the response arrives.
+        virtual void emit_with_ack(std::string const& name, message::list const& msglist, ack_listener const& ack, unsigned timeout_millis = 0) = 0;
+
+        // Dropped instead of queued when the namespace is not connected or the transport buffer is above the volatile threshold.
+        virtual void emit_volatile(std::string const& name, message::list const& msglist = nullptr, std::function<void(message::list const&)> const& ack = nullptr) = 0;
+
+        // Dropped if not handed to the transport within ttl_millis.
+        virtual void emit_ttl(std::string const& name, message::list const& msglist, unsigned ttl_millis, std::function<void(message::list const&)> const& ack = nullptr) = 0;
+
+        // Only the latest event per name and key is sent: an unsent one is replaced in place by a newer emit.
+        virtual void emit_conflated(std::string const& name, std::string const& key, message::list const& msglist) = 0;
+
+        // Buffered bytes of the transport above which volatile events are dropped, 0 by default.
+        virtual void set_volatile_threshold(size_t bytes) = 0;
+
+        virtual drop_stats get_drop_stats() const = 0;
+
+        // Caps of the queue holding encoded events while the namespace is not connected, 0 for no cap.
+        // overflow_block makes emit wait for room, except on the network thread and from listeners, whose emits are queued past the limits.
+        virtual void set_offline_limits(size_t max_bytes, size_t max_packets, overflow_policy policy) = 0;
+
+        // Bytes of encoded events held in the offline queue.
+        virtual size_t get_offline_bytes() const = 0;
 
         virtual  std::string const& get_namespace() const = 0;
 
+        virtual std::map<std::string, decode_stats> get_decode_stats() const = 0;
+
+        // Packets emitted and not yet handed to the client, including those held while the namespace is not connected.
+        virtual size_t get_buffered_packets() const = 0;
+
+        // Watermarks on the buffered packets, a high watermark of 0 disables the listeners.
+        virtual void set_buffered_packets_watermarks(size_t high, size_t low) = 0;
+
+        // Called on the network thread when the buffered packets rise to the high watermark,
+        // and when they fall back to the low watermark.
+        virtual void on_high_watermark(watermark_listener const& l) = 0;
+
+        virtual void on_low_watermark(watermark_listener const& l) = 0;
+
     protected:
         socket() {};
         static ptr create(client_base*, std::string const&);
@@ -86,7 +211,7 @@ namespace sio
 
         virtual void on_disconnect() = 0;
 
-        virtual void on_message_packet(packet const& p) = 0;
+        virtual void on_message_packet(packet&& p) = 0;
 
         friend class client_base;
     private:
@@ -0,0 +1,157 @@
+//
+//  sio_dom_reference.h
+//
+//  Packets encoded and decoded through a rapidjson Document, the way the client did before
+//  packet::accept streamed into the payload and packet::decode_json built messages from SAX events.
+//  Tests compare the library against it, benchmarks time both.
+//
+
+#ifndef SIO_DOM_REFERENCE_H
+#define SIO_DOM_REFERENCE_H
+#include <sio_message.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <sstream>
+
+namespace dom_reference
+{
+    using namespace rapidjson;
+    using sio::message;
+
+    inline void accept_message(message const& msg, Value& val, Document& doc, std::vector<std::shared_ptr<const std::string> >& buffers)
+    {
+        switch(msg.get_flag())
+        {
+        case message::flag_integer:
+            val.SetInt64(msg.get_int());
+            break;
+        case message::flag_double:
+            val.SetDouble(msg.get_double());
+            break;
+        case message::flag_string:
+            val.SetString(msg.get_string().data(), (SizeType)msg.get_string().length());
+            break;
+        case message::flag_boolean:
+            val.SetBool(msg.get_bool());
+            break;
+        case message::flag_null:
+            val.SetNull();
+            break;
+        case message::flag_binary:
+        {
+            val.SetObject();
+            Value boolVal;
+            boolVal.SetBool(true);
+            val.AddMember("_placeholder", boolVal, doc.GetAllocator());
+            Value numVal;
+            numVal.SetInt((int)buffers.size());
+            val.AddMember("num", numVal, doc.GetAllocator());
+            buffers.push_back(msg.get_binary());
+            break;
+        }
+        case message::flag_array:
+            val.SetArray();
+            for (auto it = msg.get_vector().begin(); it != msg.get_vector().end(); ++it) {
+                Value child;
+                accept_message(*(*it), child, doc, buffers);
+                val.PushBack(child, doc.GetAllocator());
+            }
+            break;
+        case message::flag_object:
+            val.SetObject();
+            for (auto it = msg.get_map().begin(); it != msg.get_map().end(); ++it) {
+                Value nameVal;
+                nameVal.SetString(it->first.data(), (SizeType)it->first.length(), doc.GetAllocator());
+                Value valueVal;
+                accept_message(*(it->second), valueVal, doc, buffers);
+                val.AddMember(nameVal, valueVal, doc.GetAllocator());
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Text frame of an event, or of an ack when is_ack is set, returns true when it has attachments.
+    inline bool accept(std::string const& nsp, message::ptr const& msg, int pack_id, bool is_ack,
+                       std::string& payload, std::vector<std::shared_ptr<const std::string> >& buffers)
+    {
+        Document doc;
+        if (msg) {
+            accept_message(*msg, doc, doc, buffers);
+        }
+        bool hasBinary = buffers.size() > 0;
+        int type = is_ack ? (hasBinary ? 6 : 3) : (hasBinary ? 5 : 2);
+        std::ostringstream ss;
+        ss << "4" << type;
+        if (hasBinary) {
+            ss << buffers.size() << "-";
+        }
+        if (nsp.size() > 0 && nsp != "/") {
+            ss << nsp;
+            if (msg || pack_id >= 0) {
+                ss << ",";
+            }
+        }
+        if (pack_id >= 0) {
+            ss << pack_id;
+        }
+        payload.append(ss.str());
+        if (msg) {
+            StringBuffer buffer;
+            Writer<StringBuffer> writer(buffer);
+            doc.Accept(writer);
+            payload.append(buffer.GetString(), buffer.GetSize());
+        }
+        return hasBinary;
+    }
+
+    inline message::ptr from_json(Value const& value)
+    {
+        if (value.IsInt64()) {
+            return sio::int_message::create(value.GetInt64());
+        }
+        else if (value.IsUint64()) {
+            return sio::int_message::create(static_cast<int64_t>(value.GetUint64()));
+        }
+        else if (value.IsDouble()) {
+            return sio::double_message::create(value.GetDouble());
+        }
+        else if (value.IsString()) {
+            return sio::string_message::create(std::string(value.GetString(), value.GetStringLength()));
+        }
+        else if (value.IsArray()) {
+            message::ptr ptr = sio::array_message::create();
+            for (SizeType i = 0; i < value.Size(); ++i) {
+                ptr->get_vector().push_back(from_json(value[i]));
+            }
+            return ptr;
+        }
+        else if (value.IsObject()) {
+            message::ptr ptr = sio::object_message::create();
+            for (auto it = value.MemberBegin(); it != value.MemberEnd(); ++it) {
+                if (it->name.IsString()) {
+                    ptr->get_map()[std::string(it->name.GetString(), it->name.GetStringLength())] = from_json(it->value);
+                }
+            }
+            return ptr;
+        }
+        else if (value.IsBool()) {
+            return sio::bool_message::create(value.GetBool());
+        }
+        else if (value.IsNull()) {
+            return sio::null_message::create();
+        }
+        return message::ptr();
+    }
+
+    inline message::ptr decode_json(std::string const& json)
+    {
+        Document doc;
+        doc.Parse<0>(json.c_str());
+        return from_json(doc);
+    }
+}
+
+#endif // SIO_DOM_REFERENCE_H
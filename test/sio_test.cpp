@@ -6,13 +6,36 @@
 
 #include <sio_client.h>
 #include <internal/sio_packet.h>
+#include <internal/sio_msgpack_codec.h>
+#include <internal/sio_mpsc_queue.h>
+#include <internal/sio_dispatcher.h>
+#include <internal/sio_message_pool.h>
+#include <internal/sio_bulk_lanes.h>
+#include <internal/sio_write_batch.h>
+#include <internal/sio_string_view.h>
+#if SIO_DEFLATE
+#include <internal/sio_deflate.h>
+#endif
+#include "sio_dom_reference.h"
+#include <websocketpp/message_buffer/message.hpp>
+#include <websocketpp/message_buffer/alloc.hpp>
 #include <functional>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
 #ifndef _WIN32
 #include "json.hpp" //nlohmann::json cannot build in MSVC
 #endif
@@ -131,6 +154,126 @@ TEST_CASE( "test_packet_accept_4" )
 }
 #endif
 
+TEST_CASE( "test_packet_accept_5" )
+{
+    message::ptr obj = object_message::create();
+    obj->get_map()["int"] = int_message::create(-42);
+    obj->get_map()["double"] = double_message::create(0.125);
+    obj->get_map()["bool"] = bool_message::create(true);
+    obj->get_map()["null"] = null_message::create();
+    obj->get_map()["text"] = string_message::create("quote\" and \\ slash");
+    message::ptr array = array_message::create();
+    array->get_vector().push_back(string_message::create("event"));
+    array->get_vector().push_back(obj);
+    array->get_vector().push_back(binary_message::create(std::make_shared<const std::string>(10,'a')));
+
+    packet p1("/nsp",array,7);
+    std::string payload1, payload2;
+    std::vector<std::shared_ptr<const std::string> > buffers1, buffers2;
+    CHECK(p1.accept(payload1,buffers1));
+    CHECK(dom_reference::accept("/nsp",array,7,false,payload2,buffers2));
+    CHECK(payload1 == payload2);
+    CHECK(buffers1 == buffers2);
+    CHECK(p1.get_type() == packet::type_binary_event);
+    CHECK(payload1.substr(0,10) == "451-/nsp,7");
+    INFO("outputing payload:" << payload1)
+}
+
+TEST_CASE( "benchmark_packet_accept", "[.][benchmark]" )
+{
+    message::ptr obj = object_message::create();
+    obj->get_map()["id"] = int_message::create(123456789);
+    obj->get_map()["price"] = double_message::create(1234.5678);
+    obj->get_map()["symbol"] = string_message::create("SIO/CPP");
+    obj->get_map()["live"] = bool_message::create(true);
+    message::ptr levels = array_message::create();
+    for (int i = 0; i < 16; ++i) {
+        levels->get_vector().push_back(int_message::create(i * 100));
+    }
+    obj->get_map()["levels"] = levels;
+    message::list args(obj);
+    const int rounds = 100000;
+
+    auto run = [&](bool stream) -> double {
+        size_t bytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            packet p("/nsp", args.to_array_message("tick"));
+            std::string payload;
+            std::vector<std::shared_ptr<const std::string> > buffers;
+            if (stream)
+                p.accept(payload, buffers);
+            else
+                dom_reference::accept(p.get_nsp(), p.get_message(), -1, false, payload, buffers);
+            bytes += payload.size();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return bytes / elapsed.count();
+    };
+    double dom = run(false);
+    double stream = run(true);
+    std::cout << "dom_reference::accept: " << dom / (1024 * 1024) << " MB/s, accept: " << stream / (1024 * 1024)
+              << " MB/s (x" << stream / dom << ")" << std::endl;
+    CHECK(stream > 0);
+}
+
+TEST_CASE( "test_message_list_move" )
+{
+    message::ptr item = int_message::create(1);
+    message::list args(item);
+    message::ptr copied = args.to_array_message("event");
+    CHECK(args.size() == 1);
+    CHECK(item.use_count() == 3);
+    message::ptr moved = std::move(args).to_array_message("event");
+    CHECK(args.size() == 0);
+    REQUIRE(moved->get_vector().size() == 2);
+    CHECK(moved->get_vector()[0]->get_string() == "event");
+    CHECK(moved->get_vector()[1] == item);
+    CHECK(item.use_count() == 3);
+}
+
+TEST_CASE( "benchmark_emit_move", "[.][benchmark]" )
+{
+    //the shared_ptr copies of emit(name, list const&) cost an atomic increment and decrement each,
+    //emit(name, list&&) moves the same pointers through to the packet.
+    const int rounds = 200000;
+    const int args_per_event = 16;
+    std::vector<message::ptr> items;
+    for (int i = 0; i < args_per_event; ++i) {
+        items.push_back(int_message::create(i));
+    }
+
+    auto run = [&](bool move) -> double {
+        auto start = std::chrono::steady_clock::now();
+        size_t count = 0;
+        for (int i = 0; i < rounds; ++i) {
+            message::list args(std::vector<message::ptr>(items.begin(), items.end()));
+            message::ptr array = move ? std::move(args).to_array_message("tick") : args.to_array_message("tick");
+            packet p("/nsp", std::move(array));
+            count += p.get_message()->get_vector().size();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        CHECK(count == (size_t)rounds * (args_per_event + 1));
+        return elapsed.count() * 1e9 / rounds;
+    };
+    double shared = run(false);
+    double moved = run(true);
+    std::cout << "emit list const&: " << shared << " ns/event, emit list&&: " << moved
+              << " ns/event (" << args_per_event << " arguments, " << 2 * args_per_event
+              << " fewer refcount operations per event)" << std::endl;
+    CHECK(moved > 0);
+}
+
+TEST_CASE( "test_packet_compress" )
+{
+    packet p("/nsp",string_message::create("text"));
+    CHECK(p.get_compress());
+    p.set_compress(false);
+    CHECK(!p.get_compress());
+    packet copy(p);
+    CHECK(!copy.get_compress());
+}
+
 TEST_CASE( "test_packet_parse_1" )
 {
     packet p;
@@ -234,3 +377,1002 @@ TEST_CASE( "test_packet_parse_4" )
     CHECK(array->get_vector()[2]->get_string() == "text");
 
 }
+
+TEST_CASE( "test_packet_parse_5" )
+{
+    std::shared_ptr<std::string> payload = std::make_shared<std::string>("42/nsp,12[\"event\",{\"text\":\"line\\nbreak\"},\"a string too long to be stored inline\"]");
+    packet p;
+    bool hasbin = p.parse(payload);
+    CHECK(!hasbin);
+    CHECK(p.get_type() == packet::type_event);
+    CHECK(p.get_nsp() == "/nsp");
+    CHECK(p.get_pack_id() == 12);
+    message::ptr msg = p.get_message();
+    REQUIRE(msg);
+    REQUIRE(msg->get_flag() == message::flag_array);
+    REQUIRE(msg->get_vector().size() == 3);
+    //read through the public accessors, the characters stay in the frame.
+    const string_message* text = static_cast<const string_message*>(msg->get_vector()[2].get());
+    CHECK(dynamic_cast<const string_view_message*>(text));
+    CHECK(text->data() >= payload->data());
+    CHECK(text->data() < payload->data() + payload->size());
+    CHECK(std::string(text->data(), text->length()) == "a string too long to be stored inline");
+    CHECK(text->get_string() == "a string too long to be stored inline");
+    //short strings are copied, they fit in the std::string itself.
+    const string_message* name = static_cast<const string_message*>(msg->get_vector()[0].get());
+    CHECK(!dynamic_cast<const string_view_message*>(name));
+    CHECK(std::string(name->data(), name->length()) == "event");
+    CHECK(msg->get_vector()[0]->get_string() == "event");
+    CHECK(msg->get_vector()[1]->get_map()["text"]->get_string() == "line\nbreak");
+}
+
+TEST_CASE( "test_packet_parse_6" )
+{
+    packet p;
+    bool hasbin = p.parse("42/nsp,[\"tick\",{\"price\":1.5},[1,2]]");
+    CHECK(!hasbin);
+    CHECK(p.get_type() == packet::type_event);
+    REQUIRE(p.has_event_name());
+    CHECK(p.get_event_name() == "tick");
+    message::ptr msg = p.get_message();
+    REQUIRE(msg);
+    REQUIRE(msg->get_vector().size() == 3);
+    CHECK(msg->get_vector()[1]->get_map()["price"]->get_double() == 1.5);
+
+    p.parse("451-[\"bin\",{\"_placeholder\":true,\"num\":0}]");
+    REQUIRE(p.has_event_name());
+    CHECK(p.get_event_name() == "bin");
+    CHECK(!p.get_message());
+    CHECK(!p.parse_buffer(std::string(10, '\4')));
+    REQUIRE(p.get_message());
+    CHECK(p.get_message()->get_vector()[1]->get_binary()->size() == 10);
+
+    p.parse("42[{\"not\":\"an event name\"}]");
+    CHECK(!p.has_event_name());
+    p.parse("43/nsp,5[\"ack\"]");
+    CHECK(!p.has_event_name());
+}
+
+TEST_CASE( "test_packet_decode_json" )
+{
+    std::string json = "[\"event\",{\"a\":[1,-2,3.5,true,false,null],\"b\":{\"c\":\"d\"},\"big\":18446744073709551615},\"e\"]";
+    message::ptr sax = packet::decode_json(json);
+    message::ptr dom = dom_reference::decode_json(json);
+    REQUIRE(sax);
+    REQUIRE(dom);
+    REQUIRE(sax->get_flag() == message::flag_array);
+    REQUIRE(sax->get_vector().size() == dom->get_vector().size());
+    message::ptr obj = sax->get_vector()[1];
+    REQUIRE(obj->get_flag() == message::flag_object);
+    std::vector<message::ptr> const& a = obj->get_map()["a"]->get_vector();
+    REQUIRE(a.size() == 6);
+    CHECK(a[1]->get_int() == -2);
+    CHECK(a[2]->get_double() == 3.5);
+    CHECK(a[3]->get_bool());
+    CHECK(a[5]->get_flag() == message::flag_null);
+    CHECK(obj->get_map()["b"]->get_map()["c"]->get_string() == "d");
+    CHECK(obj->get_map()["big"]->get_int() == dom->get_vector()[1]->get_map()["big"]->get_int());
+    CHECK(sax->get_vector()[2]->get_string() == "e");
+
+    //placeholders are left alone in packets without attachments.
+    packet p;
+    p.parse("42[\"event\",{\"_placeholder\":true,\"num\":0}]");
+    REQUIRE(p.get_message());
+    CHECK(p.get_message()->get_vector()[1]->get_flag() == message::flag_object);
+
+    CHECK(packet::decode_json("[1,")->get_flag() == message::flag_null);
+}
+
+static std::vector<packet_codec::ptr> packet_codecs()
+{
+    std::vector<packet_codec::ptr> codecs;
+    codecs.push_back(std::make_shared<json_codec>());
+    codecs.push_back(std::make_shared<msgpack_codec>());
+    return codecs;
+}
+
+// Encodes p with codec, then feeds the frames back to a packet_manager, attachments included.
+static std::vector<packet> codec_round_trip(packet_codec::ptr const& codec, packet& p)
+{
+    packet_manager manager;
+    manager.set_codec(codec);
+    std::vector<packet> decoded;
+    manager.set_decode_callback([&](packet const& q) { decoded.push_back(q); });
+    manager.encode(p, [&](bool, std::shared_ptr<const std::string> const& payload) {
+        manager.put_payload(*payload);
+    });
+    return decoded;
+}
+
+// Decodes a single frame, the way frames that fail to parse are delivered too.
+static std::vector<packet> codec_decode(packet_codec::ptr const& codec, std::string const& frame)
+{
+    packet_manager manager;
+    manager.set_codec(codec);
+    std::vector<packet> decoded;
+    manager.set_decode_callback([&](packet const& q) { decoded.push_back(q); });
+    manager.put_payload(frame);
+    return decoded;
+}
+
+static std::string codec_encode(packet_codec::ptr const& codec, packet& p)
+{
+    packet_manager manager;
+    manager.set_codec(codec);
+    std::string frame;
+    manager.encode(p, [&](bool, std::shared_ptr<const std::string> const& payload) {
+        if (frame.empty()) {
+            frame = *payload;
+        }
+    });
+    return frame;
+}
+
+TEST_CASE( "test_packet_codec_round_trip" )
+{
+    std::vector<packet_codec::ptr> codecs = packet_codecs();
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        message::ptr array = array_message::create();
+        array->get_vector().push_back(string_message::create("event"));
+        message::ptr obj = object_message::create();
+        obj->get_map()["int"] = int_message::create(-300000);
+        obj->get_map()["double"] = double_message::create(0.25);
+        obj->get_map()["text"] = string_message::create(std::string(40, 'x'));
+        obj->get_map()["flag"] = bool_message::create(true);
+        //json attachments are recognized by their leading message byte.
+        obj->get_map()["bin"] = binary_message::create(std::make_shared<std::string>("\x04\x02\x03", 3));
+        array->get_vector().push_back(obj);
+        packet p("/nsp", array, 7, false);
+        std::vector<packet> decoded = codec_round_trip(codecs[i], p);
+
+        REQUIRE(decoded.size() == 1);
+        packet const& q = decoded[0];
+        CHECK(q.get_frame() == packet::frame_message);
+        CHECK(q.get_nsp() == "/nsp");
+        CHECK(q.get_pack_id() == 7);
+        REQUIRE(q.has_event_name());
+        CHECK(q.get_event_name() == "event");
+        message::ptr msg = q.get_message();
+        REQUIRE(msg);
+        REQUIRE(msg->get_vector().size() == 2);
+        std::map<std::string, message::ptr>& m = msg->get_vector()[1]->get_map();
+        CHECK(m["int"]->get_int() == -300000);
+        CHECK(m["double"]->get_double() == 0.25);
+        CHECK(m["text"]->get_string() == std::string(40, 'x'));
+        CHECK(m["flag"]->get_bool());
+        REQUIRE(m["bin"]->get_flag() == message::flag_binary);
+        CHECK(*m["bin"]->get_binary() == std::string("\x04\x02\x03", 3));
+    }
+}
+
+TEST_CASE( "test_packet_codec_ack" )
+{
+    std::vector<packet_codec::ptr> codecs = packet_codecs();
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        message::ptr array = array_message::create();
+        array->get_vector().push_back(string_message::create("done"));
+        packet ack("/nsp", array, 1001, true);
+        std::vector<packet> decoded = codec_round_trip(codecs[i], ack);
+        REQUIRE(decoded.size() == 1);
+        CHECK(decoded[0].get_type() == packet::type_ack);
+        CHECK(decoded[0].get_pack_id() == 1001);
+        CHECK(decoded[0].get_nsp() == "/nsp");
+        CHECK(!decoded[0].has_event_name());
+        REQUIRE(decoded[0].get_message());
+        CHECK(decoded[0].get_message()->get_vector()[0]->get_string() == "done");
+
+        //acks carrying binary, the json codec sends them as binary acks with attachments.
+        array->get_vector().push_back(binary_message::create(std::make_shared<std::string>("\x04\x01", 2)));
+        packet binary_ack("/", array, 0, true);
+        decoded = codec_round_trip(codecs[i], binary_ack);
+        REQUIRE(decoded.size() == 1);
+        CHECK(decoded[0].get_type() == binary_ack.get_type());
+        CHECK(decoded[0].get_pack_id() == 0);
+        REQUIRE(decoded[0].get_message());
+        CHECK(*decoded[0].get_message()->get_vector()[1]->get_binary() == std::string("\x04\x01", 2));
+
+        //events without an ack id.
+        packet event("/nsp", array_message::create());
+        decoded = codec_round_trip(codecs[i], event);
+        REQUIRE(decoded.size() == 1);
+        CHECK(decoded[0].get_pack_id() == -1);
+    }
+}
+
+TEST_CASE( "test_packet_codec_nsp" )
+{
+    std::vector<packet_codec::ptr> codecs = packet_codecs();
+    const char* nsps[] = {"/", "/nsp", "/a/b"};
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        for (int n = 0; n < 3; ++n) {
+            packet connect(packet::type_connect, nsps[n]);
+            std::vector<packet> decoded = codec_round_trip(codecs[i], connect);
+            REQUIRE(decoded.size() == 1);
+            CHECK(decoded[0].get_type() == packet::type_connect);
+            CHECK(decoded[0].get_nsp() == nsps[n]);
+            CHECK(!decoded[0].get_message());
+
+            packet event(nsps[n], message::list("text").to_array_message("event"), 3);
+            decoded = codec_round_trip(codecs[i], event);
+            REQUIRE(decoded.size() == 1);
+            CHECK(decoded[0].get_type() == packet::type_event);
+            CHECK(decoded[0].get_nsp() == nsps[n]);
+            CHECK(decoded[0].get_pack_id() == 3);
+            CHECK(decoded[0].get_event_name() == "event");
+        }
+        //packets without a namespace belong to the main one.
+        packet anonymous(packet::type_disconnect, "");
+        std::vector<packet> decoded = codec_round_trip(codecs[i], anonymous);
+        REQUIRE(decoded.size() == 1);
+        CHECK(decoded[0].get_type() == packet::type_disconnect);
+        CHECK(decoded[0].get_nsp() == "/");
+    }
+}
+
+TEST_CASE( "test_packet_codec_binary" )
+{
+    std::vector<packet_codec::ptr> codecs = packet_codecs();
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        message::ptr nested = object_message::create();
+        nested->get_map()["deep"] = binary_message::create(std::make_shared<std::string>(100, '\4'));
+        message::ptr inner = array_message::create();
+        inner->get_vector().push_back(binary_message::create(std::make_shared<std::string>(50, '\4')));
+        inner->get_vector().push_back(nested);
+        message::list args(inner);
+        args.push(binary_message::create(std::make_shared<std::string>(1, '\4')));
+        packet p("/nsp", args.to_array_message("bin"), 101);
+        std::vector<packet> decoded = codec_round_trip(codecs[i], p);
+
+        REQUIRE(decoded.size() == 1);
+        CHECK(decoded[0].get_type() == p.get_type());
+        CHECK(decoded[0].get_pack_id() == 101);
+        CHECK(decoded[0].get_event_name() == "bin");
+        message::ptr msg = decoded[0].get_message();
+        REQUIRE(msg);
+        REQUIRE(msg->get_vector().size() == 3);
+        message::ptr array = msg->get_vector()[1];
+        REQUIRE(array->get_vector()[0]->get_flag() == message::flag_binary);
+        CHECK(array->get_vector()[0]->get_binary()->size() == 50);
+        REQUIRE(array->get_vector()[1]->get_map()["deep"]->get_flag() == message::flag_binary);
+        CHECK(array->get_vector()[1]->get_map()["deep"]->get_binary()->size() == 100);
+        REQUIRE(msg->get_vector()[2]->get_flag() == message::flag_binary);
+        CHECK(*msg->get_vector()[2]->get_binary() == std::string(1, '\4'));
+    }
+}
+
+TEST_CASE( "test_packet_codec_errors" )
+{
+    std::vector<packet_codec::ptr> codecs = packet_codecs();
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        message::ptr obj = object_message::create();
+        obj->get_map()["text"] = string_message::create(std::string(64, 'x'));
+        packet p("/nsp", message::list(obj).to_array_message("event"), 7);
+        std::string frame = codec_encode(codecs[i], p);
+        REQUIRE(frame.size() > 40);
+
+        //a frame cut short decodes to a packet carrying no data.
+        std::vector<packet> decoded = codec_decode(codecs[i], frame.substr(0, frame.size() - 20));
+        REQUIRE(decoded.size() == 1);
+        message::ptr msg = decoded[0].get_message();
+        CHECK((!msg || msg->get_flag() == message::flag_null));
+    }
+    //an unknown packet type, then an unsupported extension value.
+    std::string unknown("\x83\xa4type\x09\xa3nsp\xa1/\xa4" "data\x90");
+    std::vector<packet> decoded = codec_decode(codecs[1], unknown);
+    REQUIRE(decoded.size() == 1);
+    CHECK(decoded[0].get_type() == packet::type_error);
+    std::string extension("\x83\xa4type\x02\xa3nsp\xa1/\xa4" "data\xd4\x01\x00", 21);
+    decoded = codec_decode(codecs[1], extension);
+    REQUIRE(decoded.size() == 1);
+    CHECK(decoded[0].get_type() == packet::type_error);
+    CHECK(!decoded[0].get_message());
+    decoded = codec_decode(codecs[0], "42/nsp,7[\"event\",");
+    REQUIRE(decoded.size() == 1);
+    CHECK(decoded[0].get_message()->get_flag() == message::flag_null);
+}
+
+TEST_CASE( "test_msgpack_codec_depth" )
+{
+    packet_codec::ptr codec = std::make_shared<msgpack_codec>();
+    for (int depth = 16; depth <= 128; depth *= 8) {
+        message::ptr msg = string_message::create("leaf");
+        for (int d = 0; d < depth; ++d) {
+            message::ptr array = array_message::create();
+            array->get_vector().push_back(msg);
+            msg = array;
+        }
+        packet p("/", msg);
+        std::vector<packet> decoded = codec_round_trip(codec, p);
+        REQUIRE(decoded.size() == 1);
+        if (depth < 64) {
+            CHECK(decoded[0].get_type() == packet::type_event);
+            CHECK(decoded[0].get_message());
+        } else {
+            //rejected as a whole rather than recursing without bound.
+            CHECK(decoded[0].get_type() == packet::type_error);
+            CHECK(!decoded[0].get_message());
+        }
+    }
+}
+
+TEST_CASE( "test_packet_prepared" )
+{
+    message::list args(string_message::create("text"));
+    args.push(binary_message::create(std::make_shared<std::string>("\x04\x02\x03", 3)));
+    std::shared_ptr<prepared_event_impl> prepared = std::make_shared<prepared_event_impl>("event", args.to_array_message("event"));
+    std::vector<packet_codec::ptr> codecs;
+    codecs.push_back(std::make_shared<json_codec>());
+    codecs.push_back(std::make_shared<msgpack_codec>());
+    for (size_t i = 0; i < codecs.size(); ++i) {
+        packet_manager manager;
+        manager.set_codec(codecs[i]);
+        const char* nsps[] = {"/", "/nsp"};
+        for (int n = 0; n < 2; ++n) {
+            for (int id = -1; id <= 12; id += 13) {
+                std::vector<std::string> expected, actual;
+                std::vector<std::shared_ptr<const std::string> > buffers;
+                packet p(nsps[n], args.to_array_message("event"), id);
+                manager.encode(p, [&](bool, std::shared_ptr<const std::string> const& payload) {
+                    expected.push_back(*payload);
+                });
+                packet q(nsps[n], prepared, id);
+                manager.encode(q, [&](bool, std::shared_ptr<const std::string> const& payload) {
+                    actual.push_back(*payload);
+                    buffers.push_back(payload);
+                });
+                CHECK(actual == expected);
+                CHECK(q.get_type() == p.get_type());
+                if (buffers.size() > 1) {
+                    //attachments are shared with the prepared body, not copied.
+                    CHECK(buffers[1] == args[1]->get_binary());
+                }
+            }
+        }
+        CHECK(prepared->get_body(*codecs[i]) == prepared->get_body(*codecs[i]));
+    }
+}
+
+TEST_CASE( "test_packet_decode_whole" )
+{
+    packet_manager manager;
+    packet p;
+    CHECK(manager.decode_whole(std::make_shared<std::string>("42/nsp,3[\"event\",{\"n\":1}]"), false, p));
+    CHECK(p.get_nsp() == "/nsp");
+    CHECK(p.get_pack_id() == 3);
+    REQUIRE(p.get_message());
+    CHECK(p.get_message()->get_vector()[1]->get_map()["n"]->get_int() == 1);
+    //attachments must be joined in order by put_payload.
+    packet q;
+    CHECK(!manager.decode_whole(std::make_shared<std::string>("451-[\"event\",{\"_placeholder\":true,\"num\":0}]"), false, q));
+    packet r;
+    CHECK(!manager.decode_whole(std::make_shared<std::string>("\x04\x02", 2), false, r));
+
+    manager.set_codec(std::make_shared<msgpack_codec>());
+    std::vector<std::shared_ptr<const std::string> > frames;
+    packet source("/", p.get_message(), 5);
+    manager.encode(source, [&](bool, std::shared_ptr<const std::string> const& payload) { frames.push_back(payload); });
+    REQUIRE(frames.size() == 1);
+    packet m;
+    CHECK(manager.decode_whole(std::make_shared<std::string>(*frames[0]), false, m));
+    CHECK(m.get_pack_id() == 5);
+    REQUIRE(m.get_message());
+    CHECK(m.get_message()->get_vector()[0]->get_string() == "event");
+}
+
+TEST_CASE( "benchmark_packet_decode", "[.][benchmark]" )
+{
+    std::string json = "[\"tick\",{\"id\":123456789,\"price\":1234.5678,\"symbol\":\"SIO/CPP\",\"live\":true,"
+                       "\"levels\":[0,100,200,300,400,500,600,700,800,900,1000,1100,1200,1300,1400,1500],"
+                       "\"book\":{\"bid\":[1.25,1.5,1.75],\"ask\":[2.25,2.5,2.75],\"venue\":\"primary\"}}]";
+    const int rounds = 100000;
+
+    auto run = [&](bool sax) -> double {
+        size_t bytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            message::ptr msg = sax ? packet::decode_json(json) : dom_reference::decode_json(json);
+            bytes += msg ? json.size() : 0;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return bytes / elapsed.count();
+    };
+    double dom = run(false);
+    double sax = run(true);
+    std::cout << "dom_reference::decode_json: " << dom / (1024 * 1024) << " MB/s, decode_json: " << sax / (1024 * 1024)
+              << " MB/s (x" << sax / dom << ")" << std::endl;
+    CHECK(sax > 0);
+}
+
+#if SIO_DEFLATE
+TEST_CASE( "test_deflate_negotiation" )
+{
+    CHECK(deflate_offer(15, true) == "permessage-deflate; client_max_window_bits");
+    CHECK(deflate_offer(10, false) == "permessage-deflate; client_max_window_bits; server_max_window_bits=10; server_no_context_takeover");
+
+    deflate_negotiation accepted = negotiate_deflate("permessage-deflate; server_max_window_bits=10; server_no_context_takeover; client_max_window_bits=12");
+    CHECK(accepted.enabled);
+    CHECK(accepted.server_max_window_bits == 10);
+    CHECK(accepted.server_no_context_takeover);
+    CHECK(accepted.client_max_window_bits == 12);
+    CHECK(!accepted.client_no_context_takeover);
+
+    deflate_negotiation defaults = negotiate_deflate("permessage-deflate");
+    CHECK(defaults.enabled);
+    CHECK(defaults.server_max_window_bits == 15);
+    CHECK(defaults.client_max_window_bits == 15);
+
+    CHECK(!negotiate_deflate("").enabled);
+    CHECK(!negotiate_deflate("x-webkit-deflate-frame").enabled);
+    //websocketpp rejects parameters it does not know, and moves on to the next element.
+    CHECK(!negotiate_deflate("permessage-deflate; unknown_parameter").enabled);
+    deflate_negotiation second = negotiate_deflate("permessage-deflate; unknown_parameter, permessage-deflate; client_no_context_takeover");
+    CHECK(second.enabled);
+    CHECK(second.client_no_context_takeover);
+}
+#endif
+
+TEST_CASE( "test_mpsc_queue_order" )
+{
+    const int producers = 4;
+    const int per_producer = 10000;
+    mpsc_queue<std::pair<int, int> > queue;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < producers; ++i) {
+        threads.push_back(std::thread([&queue, i]() {
+            for (int j = 0; j < per_producer; ++j) {
+                queue.push(std::make_pair(i, j));
+            }
+        }));
+    }
+    std::vector<int> next(producers, 0);
+    int popped = 0;
+    bool ordered = true;
+    std::pair<int, int> item;
+    while (popped < producers * per_producer) {
+        if (queue.pop(item)) {
+            ordered = ordered && item.second == next[item.first];
+            next[item.first] = item.second + 1;
+            ++popped;
+        }
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    CHECK(ordered);
+    CHECK(queue.empty());
+    CHECK(!queue.pop(item));
+}
+
+TEST_CASE( "test_serial_dispatcher_order" )
+{
+    const int keys = 4;
+    const int per_key = 2000;
+    std::vector<int> next(keys, 0);
+    std::vector<std::atomic<int> > running(keys);
+    std::atomic<bool> ordered(true);
+    std::atomic<bool> serial(true);
+    {
+        worker_pool pool(4);
+        std::shared_ptr<serial_dispatcher> dispatcher =
+            std::make_shared<serial_dispatcher>(std::bind(&worker_pool::submit, &pool, std::placeholders::_1));
+        for (int j = 0; j < per_key; ++j) {
+            for (int k = 0; k < keys; ++k) {
+                dispatcher->post(std::string(1, (char)('a' + k)), [&, k, j]() {
+                    if (running[k].fetch_add(1) != 0) {
+                        serial = false;
+                    }
+                    if (next[k] != j) {
+                        ordered = false;
+                    }
+                    next[k] = j + 1;
+                    running[k].fetch_sub(1);
+                });
+            }
+        }
+        //the pool runs every queued task before its threads exit.
+    }
+    CHECK(ordered);
+    CHECK(serial);
+    for (int k = 0; k < keys; ++k) {
+        CHECK(next[k] == per_key);
+    }
+}
+
+TEST_CASE( "test_client_runtime_shared" )
+{
+    client_runtime::ptr runtime = client_runtime::create(2);
+    CHECK(runtime->get_threads() == 2);
+    CHECK(client_runtime::create()->get_threads() >= 1);
+    std::vector<client::ptr> clients;
+    for (int i = 0; i < 8; ++i) {
+        clients.push_back(client::create("http://127.0.0.1:3000", runtime));
+    }
+    //no thread of their own to poll or join.
+    CHECK(clients[0]->poll() == 0);
+    CHECK(clients[0]->run_one() == 0);
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i]->sync_close();
+    }
+    clients.clear();
+    runtime.reset();
+}
+
+#ifdef __linux__
+static size_t resident_bytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+#else
+static size_t resident_bytes()
+{
+    return 0;
+}
+#endif
+
+TEST_CASE( "benchmark_idle_clients", "[.][benchmark]" )
+{
+    //needs a socket.io server: SIO_BENCH_URL=http://127.0.0.1:3000 [SIO_BENCH_CLIENTS=10000] [SIO_BENCH_THREADS=0]
+    const char* url = getenv("SIO_BENCH_URL");
+    if (!url) {
+        WARN("SIO_BENCH_URL not set, skipped");
+        return;
+    }
+    const int count = getenv("SIO_BENCH_CLIENTS") ? atoi(getenv("SIO_BENCH_CLIENTS")) : 10000;
+    const unsigned threads = getenv("SIO_BENCH_THREADS") ? (unsigned)atoi(getenv("SIO_BENCH_THREADS")) : 0;
+    const int idle_seconds = 10;
+
+    client_runtime::ptr runtime = client_runtime::create(threads);
+    std::atomic<int> opened(0);
+    std::vector<client::ptr> clients;
+    size_t rss_before = resident_bytes();
+    for (int i = 0; i < count; ++i) {
+        client::ptr c = client::create(url, runtime);
+        c->set_logs_level(client::log_quiet);
+        c->set_open_listener([&opened]() { opened.fetch_add(1); });
+        c->connect();
+        clients.push_back(c);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (opened.load() < count && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    size_t rss_after = resident_bytes();
+
+    //idle connections only answer pings.
+    std::clock_t cpu_start = std::clock();
+    std::this_thread::sleep_for(std::chrono::seconds(idle_seconds));
+    double cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    std::cout << opened.load() << "/" << count << " clients on " << runtime->get_threads() << " threads: "
+              << (rss_after - rss_before) / (size_t)(count > 0 ? count : 1) << " bytes/connection resident, "
+              << 100.0 * cpu / idle_seconds << "% of a core idle" << std::endl;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i]->close();
+    }
+    clients.clear();
+    CHECK(opened.load() == count);
+}
+
+typedef websocketpp::message_buffer::message<pooled_msg_manager> pooled_message;
+
+TEST_CASE( "test_message_pool_recycle" )
+{
+    std::shared_ptr<pooled_msg_manager<pooled_message> > manager = std::make_shared<pooled_msg_manager<pooled_message> >();
+    pooled_message* first = NULL;
+    size_t capacity = 0;
+    {
+        pooled_message::ptr msg = manager->get_message(websocketpp::frame::opcode::binary, 0);
+        msg->append_payload(std::string(4096, 'x'));
+        msg->set_prepared(true);
+        first = msg.get();
+        capacity = msg->get_raw_payload().capacity();
+    }
+    pooled_message::ptr reused = manager->get_message(websocketpp::frame::opcode::text, 16);
+    CHECK(reused.get() == first);
+    CHECK(reused->get_opcode() == websocketpp::frame::opcode::text);
+    CHECK(reused->get_payload().empty());
+    CHECK(reused->get_raw_payload().capacity() >= capacity);
+    CHECK(!reused->get_prepared());
+    pooled_message::ptr fresh = manager->get_message(websocketpp::frame::opcode::text, 16);
+    CHECK(fresh.get() != first);
+    //messages outliving their manager are deleted.
+    manager.reset();
+    reused.reset();
+    fresh.reset();
+}
+
+TEST_CASE( "test_message_pool_threads" )
+{
+    //messages are taken on one thread and released on others, the pool stays bounded and consistent.
+    std::shared_ptr<pooled_msg_manager<pooled_message> > manager = std::make_shared<pooled_msg_manager<pooled_message> >();
+    for (int round = 0; round < 100; ++round) {
+        std::vector<pooled_message::ptr> taken;
+        for (int i = 0; i < 32; ++i) {
+            taken.push_back(manager->get_message(websocketpp::frame::opcode::binary, 64));
+            taken.back()->append_payload(std::string(64, 'x'));
+        }
+        std::vector<std::thread> releasers;
+        for (int t = 0; t < 4; ++t) {
+            std::vector<pooled_message::ptr> share(taken.begin() + t * 8, taken.begin() + (t + 1) * 8);
+            releasers.push_back(std::thread([share]() mutable { share.clear(); }));
+        }
+        taken.clear();
+        for (size_t t = 0; t < releasers.size(); ++t) {
+            releasers[t].join();
+        }
+    }
+    pooled_message::ptr reused = manager->get_message(websocketpp::frame::opcode::text, 16);
+    CHECK(reused->get_payload().empty());
+}
+
+//one outbound frame: a message taken, filled with a 1KB payload, then released once written.
+template <typename manager_type>
+static double frame_message_nanos(std::shared_ptr<manager_type> const& manager, int rounds)
+{
+    const std::string payload(1024, 'x');
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for (int i = 0; i < rounds; ++i) {
+        typename manager_type::message_ptr msg = manager->get_message(websocketpp::frame::opcode::text, payload.size());
+        msg->append_payload(payload);
+        bytes += msg->get_payload().size();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(bytes == (size_t)rounds * payload.size());
+    return elapsed.count() * 1e9 / rounds;
+}
+
+TEST_CASE( "benchmark_message_pool", "[.][benchmark]" )
+{
+    typedef websocketpp::message_buffer::message<websocketpp::message_buffer::alloc::con_msg_manager> alloc_message;
+    const int rounds = 1000000;
+    double allocated = frame_message_nanos(std::make_shared<websocketpp::message_buffer::alloc::con_msg_manager<alloc_message> >(), rounds);
+    double pooled = frame_message_nanos(std::make_shared<pooled_msg_manager<pooled_message> >(), rounds);
+    std::cout << "frame message allocated: " << allocated << " ns, pooled: " << pooled << " ns" << std::endl;
+    CHECK(pooled > 0);
+}
+
+TEST_CASE( "test_write_watermarks" )
+{
+    //the way the client drives it: each send and each write completion updates the buffered amount.
+    std::shared_ptr<pooled_msg_manager<pooled_message> > manager = std::make_shared<pooled_msg_manager<pooled_message> >();
+    write_tracker writes;
+    writes.set_watermarks(100, 10);
+    int high = 0, low = 0, written = 0;
+    auto update = [&]() {
+        switch (writes.update(writes.in_flight())) {
+        case write_tracker::crossed_high: high++; break;
+        case write_tracker::crossed_low: low++; break;
+        default: break;
+        }
+    };
+    std::vector<pooled_message::ptr> queued;
+    for (int i = 0; i < 3; ++i) {
+        pooled_message::ptr msg = manager->get_message(websocketpp::frame::opcode::binary, 0);
+        msg->append_payload(std::string(40, 'x'));
+        queued.push_back(writes.track(msg, msg->get_payload().size(), [&]() { written++; update(); }));
+        update();
+    }
+    CHECK(writes.in_flight() == 120);
+    CHECK(high == 1);
+    CHECK(low == 0);
+    //released by the transport once written, the amount falls with no sampling.
+    queued[0].reset();
+    queued[1].reset();
+    CHECK(written == 2);
+    CHECK(writes.in_flight() == 40);
+    CHECK(low == 0);
+    queued[2].reset();
+    CHECK(writes.in_flight() == 0);
+    CHECK(low == 1);
+    CHECK(high == 1);
+    //a high watermark of 0 disables the listeners.
+    writes.set_watermarks(0, 0);
+    CHECK(writes.update(1000) == write_tracker::crossed_none);
+}
+
+TEST_CASE( "test_write_batch" )
+{
+    asio::io_service io;
+    std::vector<std::string> writes;
+    write_batch batch(io, 64, [&batch, &writes]() {
+        std::string out;
+        batch.take(out);
+        writes.push_back(out);
+    });
+    //frames appended within the delay budget go out as one write.
+    batch.frames().append("aa");
+    batch.appended(1000);
+    batch.frames().append("bb");
+    batch.appended(1000);
+    CHECK(writes.empty());
+    io.run();
+    REQUIRE(writes.size() == 1);
+    CHECK(writes[0] == "aabb");
+
+    //corked, the batch waits for the last uncork.
+    io.reset();
+    batch.cork();
+    batch.cork();
+    batch.frames().append("cc");
+    batch.appended(0);
+    batch.frames().append("dd");
+    batch.appended(0);
+    io.poll();
+    CHECK(writes.size() == 1);
+    batch.uncork();
+    CHECK(writes.size() == 1);
+    batch.uncork();
+    REQUIRE(writes.size() == 2);
+    CHECK(writes[1] == "ccdd");
+
+    //a batch reaching its cap is written at once, and the budget it started is dropped.
+    batch.frames().append(std::string(40, 'x'));
+    batch.appended(1000000);
+    batch.frames().append(std::string(40, 'y'));
+    batch.appended(1000000);
+    REQUIRE(writes.size() == 3);
+    CHECK(writes[2].size() == 80);
+    io.reset();
+    io.run();
+    CHECK(writes.size() == 3);
+    CHECK(batch.empty());
+}
+
+TEST_CASE( "test_bulk_lanes_ack" )
+{
+    //events wait in the lanes while the transport is full, an ack emitted meanwhile goes straight to it.
+    typedef bulk_lanes<std::string> lanes_type;
+    lanes_type lanes;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (int i = 0; i < 4; ++i) {
+        packet event("/a", string_message::create("bulk"));
+        CHECK(!event.is_control());
+        lanes_type::item item;
+        item.frames.push_back("event");
+        item.bytes = 5;
+        lanes.push(i % 2 ? "/a" : "/b", std::move(item));
+    }
+    CHECK(lanes.size() == 4);
+    CHECK(lanes.bytes() == 20);
+
+    packet ack("/a", array_message::create(), 3, true);
+    CHECK(ack.is_control());
+    std::string payload;
+    std::vector<std::shared_ptr<const std::string> > buffers;
+    ack.accept(payload, buffers);
+    CHECK(ack.get_type() == packet::type_ack);
+    CHECK(ack.is_control());
+    CHECK(packet(packet::type_connect, "/a").is_control());
+    CHECK(!packet(packet::type_disconnect, "/a").is_control());
+
+    //expired packets are dropped on release, in round-robin order across namespaces.
+    int expired = 0;
+    lanes_type::item stale;
+    stale.frames.push_back("stale");
+    stale.bytes = 5;
+    stale.deadline = now - std::chrono::seconds(1);
+    stale.expired = [&expired]() { expired++; };
+    lanes.push("/c", std::move(stale));
+    std::vector<std::string> order;
+    lanes_type::item item;
+    while (lanes.pop(item, now)) {
+        order.push_back(item.frames.front());
+    }
+    CHECK(order.size() == 4);
+    CHECK(expired == 1);
+    CHECK(lanes.empty());
+    CHECK(lanes.bytes() == 0);
+}
+
+TEST_CASE( "test_listeners_without_connect" )
+{
+    //no network thread ever runs, replaced bindings and routes are still released right away.
+    client::ptr c = client::create("http://127.0.0.1:1");
+    sio::socket::ptr s = c->socket();
+    std::shared_ptr<int> token = std::make_shared<int>(0);
+    for (int i = 0; i < 1000; ++i) {
+        s->on("tick", [token](sio::event&) {});
+        s->on("tock", [token](sio::event&) {});
+        s->off("tick");
+    }
+    CHECK(token.use_count() == 2);
+    s->off_all();
+    CHECK(token.use_count() == 1);
+
+    long routed = s.use_count();
+    for (int i = 0; i < 100; ++i) {
+        c->socket("/nsp" + std::to_string(i));
+    }
+    CHECK(s.use_count() == routed);
+}
+
+TEST_CASE( "test_emit_async_close" )
+{
+    //never connected, the packets are still queued when the client closes the socket.
+    int sent = 0, failed = 0;
+    client::ptr c = client::create("http://127.0.0.1:3000");
+    for (int i = 0; i < 3; ++i) {
+        c->socket()->emit_async("queued", message::list("data"), nullptr, [&sent, &failed](bool ok) { ok ? sent++ : failed++; });
+    }
+    CHECK(c->socket()->get_buffered_packets() == 3);
+    c.reset();
+    CHECK(sent == 0);
+    CHECK(failed == 3);
+}
+
+TEST_CASE( "test_offline_limits" )
+{
+    //never connected and polled by hand, every emit lands in the offline queue.
+    std::vector<int> results(6, -1);
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_manual_poll(true);
+    sio::socket::ptr s = c->socket();
+    s->set_offline_limits(0, 2, sio::socket::overflow_drop_oldest);
+    for (int i = 0; i < 4; ++i) {
+        s->emit_async("offline", message::list("data"), nullptr, [&results, i](bool ok) { results[i] = ok; });
+    }
+    c->poll();
+    CHECK(s->get_drop_stats().offline_dropped == 2);
+    CHECK(results[0] == 0);
+    CHECK(results[1] == 0);
+    CHECK(results[2] == -1);
+    CHECK(s->get_buffered_packets() == 2);
+    CHECK(s->get_offline_bytes() > 0);
+
+    s->set_offline_limits(0, 2, sio::socket::overflow_drop_newest);
+    s->emit_async("offline", message::list("data"), nullptr, [&results](bool ok) { results[4] = ok; });
+    c->poll();
+    CHECK(s->get_drop_stats().offline_dropped == 3);
+    CHECK(results[4] == 0);
+    CHECK(s->get_buffered_packets() == 2);
+
+    //the polling thread is the network thread, it queues past the limit rather than wait for itself.
+    s->set_offline_limits(0, 2, sio::socket::overflow_block);
+    s->emit_async("offline", message::list("data"), nullptr, [&results](bool ok) { results[5] = ok; });
+    c->poll();
+    CHECK(s->get_drop_stats().offline_dropped == 3);
+    CHECK(s->get_buffered_packets() == 3);
+    c.reset();
+    CHECK(results[2] == 0);
+    CHECK(results[3] == 0);
+    CHECK(results[5] == 0);
+}
+
+TEST_CASE( "test_volatile_ttl_polled" )
+{
+    //never connected: volatile events are dropped, ttl events wait offline until their deadline is checked.
+    int acked = 0;
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_manual_poll(true);
+    sio::socket::ptr s = c->socket();
+    s->emit_volatile("v", message::list("data"), [&acked](message::list const&) { acked++; });
+    s->emit_volatile("v", message::list("data"));
+    s->emit_ttl("stale", message::list("data"), 0, [&acked](message::list const&) { acked++; });
+    s->emit_ttl("kept", message::list("data"), 60000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    c->poll();
+    sio::socket::drop_stats stats = s->get_drop_stats();
+    CHECK(stats.volatile_dropped == 2);
+    CHECK(stats.expired == 1);
+    CHECK(stats.offline_dropped == 0);
+    CHECK(s->get_buffered_packets() == 1);
+    CHECK(s->get_offline_bytes() > 0);
+    //the acks of dropped events are discarded, they are not failed on close either.
+    c.reset();
+    CHECK(acked == 0);
+}
+
+TEST_CASE( "test_conflation_polled" )
+{
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_manual_poll(true);
+    sio::socket::ptr s = c->socket();
+    s->emit_conflated("pos", "a", message::list("1"));
+    s->emit_conflated("pos", "a", message::list("2"));
+    s->emit_conflated("pos", "b", message::list("3"));
+    CHECK(s->get_drop_stats().conflated == 1);
+    CHECK(s->get_buffered_packets() == 2);
+    c->poll();
+    //queued offline, the slots are encoded and count in the offline bytes.
+    CHECK(s->get_buffered_packets() == 2);
+    size_t offline_bytes = s->get_offline_bytes();
+    CHECK(offline_bytes > 0);
+    //a slot waiting offline is still replaced in place.
+    s->emit_conflated("pos", "a", message::list("4"));
+    CHECK(s->get_drop_stats().conflated == 2);
+    CHECK(s->get_buffered_packets() == 2);
+
+    //a dropped slot releases its key, the next emit for it queues a new one.
+    s->set_offline_limits(0, 2, sio::socket::overflow_drop_newest);
+    s->emit_conflated("pos", "c", message::list("5"));
+    c->poll();
+    CHECK(s->get_drop_stats().offline_dropped == 1);
+    s->emit_conflated("pos", "c", message::list("6"));
+    CHECK(s->get_drop_stats().conflated == 2);
+    CHECK(s->get_buffered_packets() == 3);
+    c->poll();
+    CHECK(s->get_drop_stats().offline_dropped == 2);
+    CHECK(s->get_buffered_packets() == 2);
+    CHECK(s->get_offline_bytes() == offline_bytes);
+}
+
+TEST_CASE( "test_poll_run_one" )
+{
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_manual_poll(true);
+    sio::socket::ptr s = c->socket();
+    //nothing to do yet, and nothing to wait for.
+    CHECK(c->poll() == 0);
+    CHECK(c->run_one() == 0);
+    //work queued after an idle poll still runs, one drain handler for a burst.
+    s->emit_conflated("pos", "a", message::list("1"));
+    CHECK(c->run_one() == 1);
+    CHECK(s->get_offline_bytes() > 0);
+    CHECK(c->poll() == 0);
+    s->emit_conflated("pos", "b", message::list("2"));
+    s->emit_conflated("pos", "c", message::list("3"));
+    CHECK(c->poll() == 1);
+    CHECK(s->get_buffered_packets() == 3);
+    //the polling thread is the network thread: with nothing queued ahead, its emits need no handler.
+    sio::socket::ptr direct = c->socket("/direct");
+    direct->emit("now", message::list("data"));
+    CHECK(direct->get_buffered_packets() == 1);
+    CHECK(direct->get_offline_bytes() > 0);
+    CHECK(c->poll() == 0);
+}
+
+TEST_CASE( "test_ack_timeout_polled" )
+{
+    //the ack timer runs on the polling thread like every other handler.
+    std::vector<sio::socket::ack_status> statuses;
+    int plain = 0;
+    size_t plain_size = 1;
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_manual_poll(true);
+    sio::socket::ptr s = c->socket();
+    s->emit_with_ack("soon", message::list("data"), [&statuses](sio::socket::ack_status status, message::list const&) { statuses.push_back(status); }, 1);
+    s->emit_with_ack("never", message::list("data"), [&statuses](sio::socket::ack_status status, message::list const&) { statuses.push_back(status); });
+    s->emit("plain", message::list("data"), [&plain, &plain_size](message::list const& response) { plain++; plain_size = response.size(); });
+    for (int i = 0; i < 1000 && statuses.empty(); ++i) {
+        c->poll();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(statuses.size() == 1);
+    CHECK(statuses[0] == sio::socket::ack_timeout);
+    CHECK(plain == 0);
+    //the acks still pending fail on close, plain ones with an empty response.
+    c.reset();
+    REQUIRE(statuses.size() == 2);
+    CHECK(statuses[1] == sio::socket::ack_disconnected);
+    CHECK(plain == 1);
+    CHECK(plain_size == 0);
+}
+
+TEST_CASE( "test_emit_while_destroying" )
+{
+    //the network thread drains the burst while the client is destroyed, every packet still hears back once.
+    std::atomic<int> sent(0), failed(0);
+    client::ptr c = client::create("http://127.0.0.1:1");
+    c->set_logs_level(client::log_quiet);
+    c->set_reconnect_delay(1);
+    c->connect();
+    sio::socket::ptr s = c->socket();
+    for (int i = 0; i < 1000; ++i) {
+        s->emit_async("burst", message::list("data"), nullptr, [&sent, &failed](bool ok) { ok ? sent++ : failed++; });
+    }
+    c.reset();
+    CHECK(sent.load() == 0);
+    CHECK(failed.load() == 1000);
+    //the socket outlives its client, emits now go nowhere.
+    s->emit("late");
+    s.reset();
+}